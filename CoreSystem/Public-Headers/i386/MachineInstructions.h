@@ -51,6 +51,24 @@ static inline void EnableInterrupts()
   __asm__ __volatile__ ("sti");
 }
 
+//
+// Disables interrupts and returns the previous state
+// to be passed to RestoreInterrupts
+//
+static inline uint32_t SaveAndDisableInterrupts()
+{
+  uint32_t flags;
+  __asm__ __volatile__ ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+  return flags;
+}
+
+static inline void RestoreInterrupts(uint32_t flags)
+{
+  // Interrupt flag
+  if (flags & (1 << 9))
+    EnableInterrupts();
+}
+
 static inline void Halt()
 {
   __asm__ __volatile__ ("hlt");
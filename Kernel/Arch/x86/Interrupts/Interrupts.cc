@@ -27,6 +27,9 @@
 #include <CoreSystem/MachineInstructions.h>
 #include "Logging/Logging.h"
 #include "Error/Panic.h"
+#include "Interrupts/Idle.h"
+#include "Utils/CPU.h"
+#include "Utils/DeferredRelease.h"
 
 namespace Interrupts {
 namespace X86 {
@@ -330,6 +333,20 @@ uint32_t GetKernelStack()
 	return tss.esp0;
 }
 
+// Handlers running on each cpu, they nest for exceptions and
+// while the outermost handler destroys deferred objects
+static uint32_t HandlerDepth[kCPUMaxCount];
+
+bool IsHandlingInterrupt()
+{
+	return HandlerDepth[CPUGetCurrentNumber()] != 0;
+}
+
+bool IsHandlingNestedInterrupt()
+{
+	return HandlerDepth[CPUGetCurrentNumber()] > 1;
+}
+
 // The Halt CPU State
 // ==================
 
@@ -339,13 +356,17 @@ uint32_t GetKernelStack()
 const uint32_t kHaltCPUStackSize = sizeof(CPUState) + 4096;
 uint8_t HaltCPUStack[kHaltCPUStackSize];
 
-void HaltCPU() __attribute__((naked));
-
 void HaltCPU()
 {
-	__asm__ volatile ("1: hlt; jmp 1;");
 	while (1) {
-		Halt();
+		// Do pending idle work piece by piece, so interrupts
+		// are only held off shortly
+		DisableInterrupts();
+		bool pending = IdleRun();
+		EnableInterrupts();
+		
+		if (!pending)
+			Halt();
 	}
 }
 
@@ -355,7 +376,10 @@ void HaltCPU()
 extern "C" const CPUState* InterruptsHandler(const CPUState* ptr)
 {
 	const CPUState* newState;
+	uint32_t cpu = CPUGetCurrentNumber();
 	LogInfo("Interrupt");
+	
+	HandlerDepth[cpu]++;
 
 // Debug print of interrupt state	
 #if 0
@@ -402,6 +426,15 @@ extern "C" const CPUState* InterruptsHandler(const CPUState* ptr)
 		outb(0x20,0x20);
 	// TODO: EOI for second pic
 
+	// Leaving the outermost handler is the safe point to destroy
+	// the objects handlers released. Interrupts are on meanwhile,
+	// the depth stays so they nest and do not switch away.
+	if (HandlerDepth[cpu] == 1 && HasDeferredObjects()) {
+		EnableInterrupts();
+		ReclaimDeferredObjects();
+		DisableInterrupts();
+	}
+
 	// TODO when ptr is NULL use halt cpu state
 	if (newState == NULL) {
 		newState = reinterpret_cast<CPUState*>(OFFSET(&HaltCPUStack[kHaltCPUStackSize - 1], -sizeof(CPUState)));
@@ -447,6 +480,8 @@ extern "C" const CPUState* InterruptsHandler(const CPUState* ptr)
 	LogInfo("   ss = %x", newState->ss);
 #endif
 
+	HandlerDepth[cpu]--;
+
 	return newState;
 }
 
@@ -122,5 +122,17 @@ void SetKernelStack(uint32_t stack);
 //
 uint32_t GetKernelStack();
 
+//
+// Whether the calling cpu is running an interrupt
+// or exception handler
+//
+bool IsHandlingInterrupt();
+
+//
+// Whether the running handler interrupted another handler,
+// which has to be resumed instead of switching to another state
+//
+bool IsHandlingNestedInterrupt();
+
 }
 }
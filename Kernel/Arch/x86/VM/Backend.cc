@@ -96,20 +96,25 @@ void Initialize()
 	KernelContext = new class KernelContext();
 }
 
+void AccountKernelMappings()
+{
+	KernelContext->accountKernelMappings();
+}
+
 Context::Context(VMBackendMapOptions options, bool initialize) : VM::Backend::Context(options)
 {		
-	if (!PhyMemAlloc(&this->paddrPageDirectory)) {
+	// A new page directory comes zeroed, so only the
+	// kernel tables need to be inserted. The kernel
+	// context fills its own before zeroed pages exist.
+	bool success = initialize ? PhyMemAllocZeroed(&this->paddrPageDirectory) : PhyMemAlloc(&this->paddrPageDirectory);
+	
+	if (!success) {
 		return;
 	}
 	
 	if (initialize) {
 		this->beginAccess();
 	
-		// Clear new page directory
-		for (uint32_t i = 0; i < (KERNEL_LOAD_ADDRESS >> 22 & 0x03FF); i++) {
-			this->pageDirectory->entries[i] = 0;
-		}
-	
 		// Insert kernel tables
 		KernelContext->beginAccess();
 		for (uint32_t i = (KERNEL_LOAD_ADDRESS >> 22 & 0x03FF);
@@ -157,6 +162,8 @@ bool Context::map(page_t paddr, pointer_t vaddr, Permission permissions, VMBacke
 		EntrySetPAddr(entry, paddr);
 		// Always add the present option
 		EntrySetOptions(entry, options|VMBackendOptionPresent);
+		
+		PhyMemFrameMapped(paddr);
 	}
 	
 	this->endAccess();
@@ -175,7 +182,7 @@ bool Context::unmap(pointer_t vaddr)
 	uint32_t tableIndex = tableIndexFromAddress(vaddr);
 	
 	// Table is not present,so cannot unmap
-	if (EntryGetOptions(&this->pageDirectory->entries[tableIndex]) & VMBackendOptionPresent) {
+	if (!(EntryGetOptions(&this->pageDirectory->entries[tableIndex]) & VMBackendOptionPresent)) {
 		success=false;
 	}
 	else {
@@ -187,10 +194,13 @@ bool Context::unmap(pointer_t vaddr)
 			success = false;
 		}
 		else {
+			PhyMemFrameUnmapped(EntryGetPAddr(entry));
+			
 			// Just clear the whole thing, no need to do something
 			// bity here, as it doesnt matter as long as the present bit
 			// is cleared
-			entry = 0;
+			*entry = 0;
+			invalidatePage(vaddr);
 		}
 	}
 	
@@ -221,6 +231,27 @@ page_t Context::translate(pointer_t vaddr)
 	return page;
 }
 
+void Context::accountKernelMappings()
+{
+	this->beginAccess();
+	
+	for (uint32_t tableIndex = (KERNEL_LOAD_ADDRESS >> 22 & 0x03FF);
+		 tableIndex < 1023; // Not 1024, because the pd is mapped there
+		 tableIndex++) {
+		if (!(EntryGetOptions(&this->pageDirectory->entries[tableIndex]) & VMBackendOptionPresent))
+			continue;
+		
+		PageTable* table = OFFSET(this->pageTablesBase, tableIndex * sizeof(PageTable));
+		
+		for (uint32_t i = 0; i < 1024; i++) {
+			if (EntryGetOptions(&table->entries[i]) & VMBackendOptionPresent)
+				PhyMemFrameMapped(EntryGetPAddr(&table->entries[i]));
+		}
+	}
+	
+	this->endAccess();
+}
+
 bool Context::makeAccessible()
 {
 	// Find a spot to temporarly put our context
@@ -296,12 +327,17 @@ KernelContext::KernelContext() : Context(VMBackendOptionGlobal, false)
 	// into the other contexts but we can keep mapping pages
 	for (uint32_t i = (KERNEL_LOAD_ADDRESS >> 22 & 0x03FF);
 		 i < 1023; // Not 1024, because the pd is mapped there
-		 i++) {
-		page_t page;
-		assert(PhyMemAlloc(&page));
+		 ) {
+		// Allocate the tables in batches
+		page_t pages[32];
+		uint32_t count = 1023 - i < 32 ? 1023 - i : 32;
+		
+		assert(PhyMemAllocBatch(pages, count));
 		
-		EntrySetPAddr(&d->entries[i], page);
-		EntrySetOptions(&d->entries[i], VMBackendOptionWriteable|VMBackendOptionGlobal|VMBackendOptionPresent);
+		for (uint32_t j = 0; j < count; j++, i++) {
+			EntrySetPAddr(&d->entries[i], pages[j]);
+			EntrySetOptions(&d->entries[i], VMBackendOptionWriteable|VMBackendOptionGlobal|VMBackendOptionPresent);
+		}
 	}
 	
 	// Add pd as last entry
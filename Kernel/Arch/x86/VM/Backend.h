@@ -43,6 +43,7 @@ typedef struct {
 } PageTable;
 
 void Initialize();
+void AccountKernelMappings();
 
 // The Context used for paging on X86
 class Context : public VM::Backend::Context {
@@ -69,6 +70,10 @@ protected:
 	Context(VMBackendMapOptions options, bool initialize);
 public:
 	Context(VMBackendMapOptions options) : Context(options, true) {}
+	
+	// Calls PhyMemFrameMapped for every present page
+	// above KERNEL_LOAD_ADDRESS
+	void accountKernelMappings();
 };
 
 extern GlobalPtr<Context> KernelContext;
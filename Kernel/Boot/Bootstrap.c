@@ -68,6 +68,10 @@ void Bootstrap()
 	// so that the needed table gets allocated which we can not do
 	// later
 	BooststrapMap((uint32_t)BootstrapPageDirectory, 0xFFFFF000, 0x1000);
+	
+	// Same for the PhyMem bitmaps, the real mapping is
+	// made when the memory map is known
+	BooststrapMap((uint32_t)BootstrapPageDirectory, kBootstrapPhyMemBitmapAddress, 0x1000);
 }
 
 void BooststrapMap(uint32_t paddr, uint32_t vaddr, uint32_t _size)
@@ -43,6 +43,13 @@ extern "C" {
 
 #define BOOTSTRAP_SECTION  __attribute__ ((section (".bootstrap")))
 
+//
+// Where the PhyMem bitmaps are mapped. Bootstrap creates the
+// page table for it up front, as no tables can be allocated
+// once paging is enabled.
+//
+static const uint32_t kBootstrapPhyMemBitmapAddress = 0xE0400000;
+
 //
 // This temporarly maps paddr->vaddr for size.
 //
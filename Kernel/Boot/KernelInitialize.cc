@@ -41,7 +41,7 @@
 // got a real heap.
 //
 // Note: Heap is still valid, after boot up
-char StartupHeap[4*1024];
+char StartupHeap[8*1024];
 
 extern "C" void KernelInitialize(uint32_t magic, struct Multiboot* header)
 {	
@@ -57,6 +57,7 @@ extern "C" void KernelInitialize(uint32_t magic, struct Multiboot* header)
 	_PhyMemMarkUsedRange(KernelOffset, KernelLength);
 	_PhyMemMarkUsedRange(KernelBootstrapOffset, KernelBootstrapLength);
 	BootstrapPhyMemInitialize();
+	PhyMemReserveFrameDatabase(MultibootGetPageCount(header));
 	LogPhyMem();
 	
 	KallocInitialize(StartupHeap, sizeof(StartupHeap));
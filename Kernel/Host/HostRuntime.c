@@ -0,0 +1,130 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE
+
+#include "HostRuntime.h"
+
+#include "Error/Panic.h"
+#include "Logging/Logging.h"
+#include "Utils/CPU.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+static const size_t kHostPageSize = 4096;
+
+static size_t MappedBytes;
+static size_t PeakMappedBytes;
+
+static _Thread_local uint32_t CurrentCPU;
+
+void* HostMapPages(size_t count)
+{
+	void* address = mmap(NULL, count * kHostPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if (address == MAP_FAILED)
+		return NULL;
+	
+	size_t mapped = __sync_add_and_fetch(&MappedBytes, count * kHostPageSize);
+	size_t peak = PeakMappedBytes;
+	
+	while (mapped > peak && !__sync_bool_compare_and_swap(&PeakMappedBytes, peak, mapped))
+		peak = PeakMappedBytes;
+	
+	return address;
+}
+
+void HostUnmapPages(void* address, size_t count)
+{
+	if (munmap(address, count * kHostPageSize) != 0)
+		panic("Unmapping %d pages at %p failed.", count, address);
+	
+	__sync_sub_and_fetch(&MappedBytes, count * kHostPageSize);
+}
+
+size_t HostMappedBytes()
+{
+	return MappedBytes;
+}
+
+size_t HostPeakMappedBytes()
+{
+	return PeakMappedBytes;
+}
+
+void HostSetCurrentCPU(uint32_t cpu)
+{
+	if (cpu >= kCPUMaxCount)
+		panic("There is no cpu %d.", cpu);
+	
+	CurrentCPU = cpu;
+}
+
+uint32_t HostGetCurrentCPU()
+{
+	return CurrentCPU;
+}
+
+//
+// Kernel functions
+// ================
+//
+
+void panic(const char* message, ...)
+{
+	va_list args;
+	
+	va_start(args, message);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, message, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+	
+	abort();
+}
+
+void _Log(const char* function, const char* filename, uint32_t line, LogLevel logLevel, const char* format, ...)
+{
+	va_list args;
+	
+	va_start(args, format);
+	_Log_va(function, filename, line, logLevel, format, args);
+	va_end(args);
+}
+
+void _Log_va(const char* function, const char* filename, uint32_t line, LogLevel logLevel, const char* format, va_list args)
+{
+	(void)filename;
+	(void)line;
+	
+	// Keep the benchmark output readable
+	if (logLevel > kLogLevelInfo)
+		return;
+	
+	fprintf(stderr, "%s: ", function);
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+}
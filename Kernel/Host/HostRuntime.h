@@ -0,0 +1,71 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <CoreSystem/CommonTypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Host runtime
+// ============
+//
+// Implements what the allocators need from the kernel on top of
+// the host libc, and keeps the numbers the benchmarks report.
+//
+
+//
+// Maps count zeroed pages. They count towards the footprint
+// until unmapped.
+//
+// @return the page aligned address or NULL
+//
+void* HostMapPages(size_t count);
+
+//
+// Unmaps pages mapped with HostMapPages
+//
+void HostUnmapPages(void* address, size_t count);
+
+//
+// The bytes mapped right now
+//
+size_t HostMappedBytes();
+
+//
+// The most bytes that were mapped at once
+//
+size_t HostPeakMappedBytes();
+
+//
+// Sets the cpu number the calling thread runs as
+//
+void HostSetCurrentCPU(uint32_t cpu);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,59 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "HostRuntime.h"
+
+#include "VM/VM.h"
+#include "VM/KernelPages.h"
+
+//
+// Host shim
+// =========
+//
+// The page owner map gets its leaves from OwnerMapPages once the
+// kernel context is active. On the host the context is always
+// active and the pages come from the host runtime.
+//
+
+namespace VM {
+
+KernelPageRange OwnerMapPages(0, kOffsetMax / kPhyMemPageSize, nullptr);
+
+bool IsKernelContextActive()
+{
+	return true;
+}
+
+// Fresh anonymous mappings are always zeroed
+pointer_t KernelPageRange::allocate(size_t count, bool)
+{
+	return HostMapPages(count);
+}
+
+void KernelPageRange::free(pointer_t address, size_t count)
+{
+	HostUnmapPages(address, count);
+}
+
+} // namespace VM
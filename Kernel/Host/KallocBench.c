@@ -0,0 +1,505 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE
+
+#include "HostRuntime.h"
+
+#include "Memory/kalloc.h"
+#include "Memory/PhyMem.h"
+#include "Error/Panic.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// Kalloc benchmarks
+// =================
+//
+// Runs kalloc through a few allocation patterns and reports for each
+//  - ns/op: the time per allocation or free
+//  - frag: the peak footprint divided by the peak of live bytes
+//  - peak: the most memory kalloc had mapped at once, including
+//    its startup heap and the page owner map
+//  - retained: what is still mapped after everything was freed
+//    and the heaps were trimmed
+//
+// Every benchmark runs in its own process so it starts with a fresh
+// allocator, and uses a fixed seed so runs can be compared.
+//
+// The benchmarks double as stress tests. Every allocation is stamped
+// and checked when freed, so overlapping allocations fail the run.
+//
+
+static const size_t kStartupHeapPages = 64;
+
+typedef struct {
+	uint64_t operations;
+	size_t liveBytes;
+	size_t peakLiveBytes;
+} Stats;
+
+static inline uint32_t Random(uint32_t* state)
+{
+	uint32_t x = *state;
+	
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	
+	return *state = x;
+}
+
+static inline size_t RandomSize(uint32_t* state, size_t min, size_t max)
+{
+	return min + Random(state) % (max - min + 1);
+}
+
+static inline uint8_t Stamp(uint8_t* ptr, size_t size)
+{
+	return (uint8_t)(((offset_t)ptr >> 3) ^ size);
+}
+
+static void Track(Stats* stats, uint8_t* ptr, size_t size)
+{
+	ptr[0] = ptr[size - 1] = Stamp(ptr, size);
+	
+	size_t live = __sync_add_and_fetch(&stats->liveBytes, size);
+	size_t peak = stats->peakLiveBytes;
+	
+	while (live > peak && !__sync_bool_compare_and_swap(&stats->peakLiveBytes, peak, live))
+		peak = stats->peakLiveBytes;
+	
+	__sync_fetch_and_add(&stats->operations, 1);
+}
+
+static void Untrack(Stats* stats, uint8_t* ptr, size_t size)
+{
+	uint8_t stamp = Stamp(ptr, size);
+	
+	if (ptr[0] != stamp || ptr[size - 1] != stamp)
+		panic("The allocation of %d bytes at %p was overwritten.", size, ptr);
+	
+	__sync_sub_and_fetch(&stats->liveBytes, size);
+}
+
+static void* Allocate(Stats* stats, size_t size)
+{
+	uint8_t* ptr = kalloc(size);
+	
+	if (ptr == NULL)
+		panic("kalloc(%d) failed.", size);
+	
+	if ((offset_t)ptr & 7)
+		panic("kalloc(%d) returned %p which is not 8 byte aligned.", size, ptr);
+	
+	Track(stats, ptr, size);
+	
+	return ptr;
+}
+
+static void* AllocateAligned(Stats* stats, size_t size, size_t align)
+{
+	uint8_t* ptr = kalloc_aligned(size, align);
+	
+	if (ptr == NULL)
+		panic("kalloc_aligned(%d, %d) failed.", size, align);
+	
+	if ((offset_t)ptr & (align - 1))
+		panic("kalloc_aligned(%d, %d) returned %p.", size, align, ptr);
+	
+	Track(stats, ptr, size);
+	
+	return ptr;
+}
+
+//
+// Resizes an allocation, the first byte has to move along
+//
+static void* Reallocate(Stats* stats, void* ptr, size_t size, size_t newSize)
+{
+	uint8_t stamp = Stamp(ptr, size);
+	
+	Untrack(stats, ptr, size);
+	
+	uint8_t* newPtr = krealloc(ptr, newSize);
+	
+	if (newPtr == NULL)
+		panic("krealloc(%p, %d) failed.", ptr, newSize);
+	
+	if (newPtr[0] != stamp)
+		panic("krealloc(%p, %d) lost the contents.", ptr, newSize);
+	
+	Track(stats, newPtr, newSize);
+	
+	return newPtr;
+}
+
+static void Free(Stats* stats, void* ptr, size_t size)
+{
+	Untrack(stats, ptr, size);
+	free(ptr);
+	
+	__sync_fetch_and_add(&stats->operations, 1);
+}
+
+static void FreeSized(Stats* stats, void* ptr, size_t size)
+{
+	Untrack(stats, ptr, size);
+	kfree_sized(ptr, size);
+	
+	__sync_fetch_and_add(&stats->operations, 1);
+}
+
+//
+// Uniform small
+// =============
+//
+// Allocates a batch of equally sized small objects and frees them
+// again in the same order, the best case for caches and bins.
+//
+
+static const size_t kUniformCount = 1024;
+static const size_t kUniformRounds = 2000;
+static const size_t kUniformSize = 32;
+
+static void UniformSmall(Stats* stats)
+{
+	void* objects[kUniformCount];
+	
+	for (size_t round = 0; round < kUniformRounds; round++) {
+		for (size_t i = 0; i < kUniformCount; i++)
+			objects[i] = Allocate(stats, kUniformSize);
+		
+		for (size_t i = 0; i < kUniformCount; i++)
+			Free(stats, objects[i], kUniformSize);
+	}
+}
+
+//
+// Mixed sizes
+// ===========
+//
+// Randomly allocates and frees objects of mostly small sizes, with
+// some medium ones and a few big enough to get their own pages.
+// Some allocations are aligned, some are resized with krealloc and
+// some are freed with their size. Every now and then the heaps are
+// trimmed while the objects are still live.
+//
+
+static const size_t kMixedSlots = 4096;
+static const size_t kMixedIterations = 2000000;
+static const size_t kMixedTrimInterval = 100000;
+
+static size_t MixedSize(uint32_t* seed)
+{
+	uint32_t kind = Random(seed) % 100;
+	
+	if (kind < 70)
+		return RandomSize(seed, 8, 128);
+	else if (kind < 95)
+		return RandomSize(seed, 129, 2048);
+	else
+		return RandomSize(seed, 2049, 65536);
+}
+
+static void MixedSizes(Stats* stats)
+{
+	static void* objects[kMixedSlots];
+	static size_t sizes[kMixedSlots];
+	uint32_t seed = 0x2545F491;
+	
+	for (size_t i = 0; i < kMixedIterations; i++) {
+		size_t slot = Random(&seed) % kMixedSlots;
+		uint32_t kind = Random(&seed) % 100;
+		
+		if (objects[slot] && kind < 10) {
+			size_t newSize = MixedSize(&seed);
+			
+			objects[slot] = Reallocate(stats, objects[slot], sizes[slot], newSize);
+			sizes[slot] = newSize;
+		}
+		else if (objects[slot]) {
+			if (kind < 50)
+				FreeSized(stats, objects[slot], sizes[slot]);
+			else
+				Free(stats, objects[slot], sizes[slot]);
+			
+			objects[slot] = NULL;
+		}
+		else {
+			sizes[slot] = MixedSize(&seed);
+			
+			// 16 up to 4096 byte alignment
+			if (kind < 10)
+				objects[slot] = AllocateAligned(stats, sizes[slot], (size_t)16 << (kind % 9));
+			else
+				objects[slot] = Allocate(stats, sizes[slot]);
+		}
+		
+		if ((i + 1) % kMixedTrimInterval == 0)
+			KallocTrim();
+	}
+	
+	for (size_t slot = 0; slot < kMixedSlots; slot++) {
+		if (objects[slot])
+			Free(stats, objects[slot], sizes[slot]);
+	}
+}
+
+//
+// Producer consumer
+// =================
+//
+// One cpu allocates objects and hands them to another cpu through
+// a ring, which frees them. Every free is a remote free.
+//
+
+static const size_t kProducedObjects = 1000000;
+static const uint32_t kRingSize = 1024;
+
+typedef struct {
+	void* ptr;
+	size_t size;
+} RingEntry;
+
+static RingEntry Ring[kRingSize];
+static uint32_t RingHead;
+static uint32_t RingTail;
+
+static void* Consumer(void* context)
+{
+	Stats* stats = context;
+	
+	HostSetCurrentCPU(1);
+	
+	for (size_t i = 0; i < kProducedObjects; i++) {
+		while (__atomic_load_n(&RingHead, __ATOMIC_ACQUIRE) == RingTail)
+			__builtin_ia32_pause();
+		
+		RingEntry entry = Ring[RingTail % kRingSize];
+		__atomic_store_n(&RingTail, RingTail + 1, __ATOMIC_RELEASE);
+		
+		Free(stats, entry.ptr, entry.size);
+	}
+	
+	return NULL;
+}
+
+static void ProducerConsumer(Stats* stats)
+{
+	pthread_t consumer;
+	uint32_t seed = 0x9E3779B9;
+	
+	if (pthread_create(&consumer, NULL, &Consumer, stats) != 0)
+		panic("Could not start the consumer.");
+	
+	for (size_t i = 0; i < kProducedObjects; i++) {
+		size_t size = RandomSize(&seed, 16, 256);
+		void* ptr = Allocate(stats, size);
+		
+		while (RingHead - __atomic_load_n(&RingTail, __ATOMIC_ACQUIRE) == kRingSize)
+			__builtin_ia32_pause();
+		
+		Ring[RingHead % kRingSize] = (RingEntry){ ptr, size };
+		__atomic_store_n(&RingHead, RingHead + 1, __ATOMIC_RELEASE);
+	}
+	
+	pthread_join(consumer, NULL);
+}
+
+//
+// Fragmentation churn
+// ===================
+//
+// Fills the heap with small objects, then keeps replacing a quarter
+// of them with objects of another size class. The holes the small
+// objects leave behind only fit large ones once they coalesce.
+//
+
+static const size_t kChurnSlots = 16384;
+static const size_t kChurnRounds = 64;
+
+static void FragmentationChurn(Stats* stats)
+{
+	static void* objects[kChurnSlots];
+	static size_t sizes[kChurnSlots];
+	uint32_t seed = 0x6C078965;
+	
+	for (size_t slot = 0; slot < kChurnSlots; slot++) {
+		sizes[slot] = RandomSize(&seed, 16, 64);
+		objects[slot] = Allocate(stats, sizes[slot]);
+	}
+	
+	for (size_t round = 1; round <= kChurnRounds; round++) {
+		for (size_t slot = round % 4; slot < kChurnSlots; slot += 4) {
+			Free(stats, objects[slot], sizes[slot]);
+			
+			if (round % 2 == 0)
+				sizes[slot] = RandomSize(&seed, 16, 64);
+			else
+				sizes[slot] = RandomSize(&seed, 512, 2048);
+			
+			objects[slot] = Allocate(stats, sizes[slot]);
+		}
+	}
+	
+	for (size_t slot = 0; slot < kChurnSlots; slot++)
+		Free(stats, objects[slot], sizes[slot]);
+}
+
+//
+// Shrinking reallocations
+// =======================
+//
+// Shrinks allocations of every size with krealloc, including ones
+// which got pages of their own, and frees them with kfree_sized and
+// their new size. Page aligned allocations are freed the same way.
+//
+
+static const size_t kShrinkRounds = 20000;
+
+static void ReallocShrink(Stats* stats)
+{
+	uint32_t seed = 0x1B873593;
+	
+	for (size_t round = 0; round < kShrinkRounds; round++) {
+		size_t size = RandomSize(&seed, 8, 256 * 1024);
+		size_t newSize = RandomSize(&seed, 1, size);
+		void* ptr = Allocate(stats, size);
+		
+		ptr = Reallocate(stats, ptr, size, newSize);
+		FreeSized(stats, ptr, newSize);
+		
+		size = RandomSize(&seed, 1, 64 * 1024);
+		ptr = AllocateAligned(stats, size, kPhyMemPageSize);
+		FreeSized(stats, ptr, size);
+	}
+}
+
+//
+// Runner
+// ======
+//
+
+typedef struct {
+	const char* name;
+	void (*run)(Stats* stats);
+} Benchmark;
+
+static const Benchmark Benchmarks[] = {
+	{ "uniform-small", &UniformSmall },
+	{ "mixed-sizes", &MixedSizes },
+	{ "producer-consumer", &ProducerConsumer },
+	{ "fragmentation-churn", &FragmentationChurn },
+	{ "realloc-shrink", &ReallocShrink },
+};
+
+static const size_t kBenchmarkCount = sizeof(Benchmarks) / sizeof(Benchmarks[0]);
+
+static uint64_t Now()
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void Run(const Benchmark* benchmark)
+{
+	Stats stats = {0};
+	
+	HostSetCurrentCPU(0);
+	KallocInitialize(HostMapPages(kStartupHeapPages), kStartupHeapPages * kPhyMemPageSize);
+	KallocSetPageProvider(&HostMapPages, &HostUnmapPages);
+	
+	uint64_t start = Now();
+	benchmark->run(&stats);
+	uint64_t elapsed = Now() - start;
+	
+	if (stats.liveBytes != 0)
+		panic("%s leaked %d bytes.", benchmark->name, stats.liveBytes);
+	
+	KallocTrim();
+	
+	printf("%-20s %10.1f %8.2f %10u KiB %10u KiB\n", benchmark->name,
+	       (double)elapsed / (double)stats.operations,
+	       (double)HostPeakMappedBytes() / (double)stats.peakLiveBytes,
+	       HostPeakMappedBytes() / 1024, HostMappedBytes() / 1024);
+	
+	LogKallocProfile();
+}
+
+//
+// Runs the benchmarks named on the command line, or all of them.
+//
+// @return 0 when every benchmark passed its checks
+//
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	
+	printf("%-20s %10s %8s %14s %14s\n", "benchmark", "ns/op", "frag", "peak", "retained");
+	
+	for (size_t i = 0; i < kBenchmarkCount; i++) {
+		const Benchmark* benchmark = &Benchmarks[i];
+		bool selected = argc < 2;
+		
+		for (int arg = 1; arg < argc; arg++) {
+			if (strcmp(argv[arg], benchmark->name) == 0)
+				selected = true;
+		}
+		
+		if (!selected)
+			continue;
+		
+		fflush(stdout);
+		
+		pid_t child = fork();
+		int status;
+		
+		if (child < 0) {
+			perror("fork");
+			return 1;
+		}
+		
+		if (child == 0) {
+			Run(benchmark);
+			fflush(stdout);
+			_exit(0);
+		}
+		
+		if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("%-20s failed\n", benchmark->name);
+			failed = 1;
+		}
+	}
+	
+	return failed;
+}
@@ -0,0 +1,68 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// Host shim
+// =========
+//
+// Stands in for the machine instructions of CoreSystem when the
+// kernel code is built for the host. User space can't touch the
+// interrupt flag, so these do nothing.
+//
+
+#ifndef MACHINE_INSTRUCTIONS_H
+#define MACHINE_INSTRUCTIONS_H
+
+#include <CoreSystem/Integers.h>
+
+static inline void DisableInterrupts()
+{
+}
+
+static inline void EnableInterrupts()
+{
+}
+
+static inline uint32_t SaveAndDisableInterrupts()
+{
+	return 0;
+}
+
+static inline void RestoreInterrupts(uint32_t flags)
+{
+	(void)flags;
+}
+
+static inline void Halt()
+{
+}
+
+static inline uint64_t TimeStampCounter(void)
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+#endif /* MACHINE_INSTRUCTIONS_H */
@@ -43,5 +43,7 @@ using Native::CPUState;
 using Native::Handler;
 using Native::MaskIRQ;
 using Native::UnmaskIRQ;
+using Native::IsHandlingInterrupt;
+using Native::IsHandlingNestedInterrupt;
 
 }
@@ -0,0 +1,97 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "Arena.h"
+
+#include "Memory/kalloc.h"
+
+struct Arena::Block {
+	// The next older block
+	Block* next;
+	size_t size;
+};
+
+static const size_t kBlockHeaderSize = (sizeof(Arena::Block) + 0x7) & ~(size_t)0x7;
+
+bool Arena::addBlock(size_t size)
+{
+	// Large requests get a block of their own
+	if (size < this->blockSize - kBlockHeaderSize)
+		size = this->blockSize;
+	else
+		size += kBlockHeaderSize;
+	
+	Block* block = (Block*)kalloc(size);
+	
+	if (block == NULL)
+		return false;
+	
+	block->next = this->blocks;
+	block->size = size;
+	
+	this->blocks = block;
+	this->position = (offset_t)block + kBlockHeaderSize;
+	this->limit = (offset_t)block + size;
+	
+	return true;
+}
+
+void* Arena::allocate(size_t size)
+{
+	// Even empty requests take a slot, so each gets a distinct pointer
+	// and a fresh arena does not answer with NULL
+	if (size == 0)
+		size = 1;
+	
+	size = (size + 0x7) & ~(size_t)0x7;
+	
+	if (this->limit - this->position < size && !this->addBlock(size))
+		return NULL;
+	
+	void* ptr = (void*)this->position;
+	this->position += size;
+	
+	return ptr;
+}
+
+void Arena::reset(Mark mark)
+{
+	while (this->blocks != mark.block) {
+		Block* block = this->blocks;
+		
+		assert(block != NULL);
+		
+		this->blocks = block->next;
+		kfree_sized(block, block->size);
+	}
+	
+	if (mark.block) {
+		this->position = mark.position;
+		this->limit = (offset_t)mark.block + mark.block->size;
+	}
+	else {
+		this->position = 0;
+		this->limit = 0;
+	}
+}
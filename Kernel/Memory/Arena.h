@@ -0,0 +1,124 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <CoreSystem/CommonTypes.h>
+#include "Utils/KObject.h"
+#include "Utils/New.h"
+
+//
+// Arenas
+// ======
+//
+// An Arena hands out memory by bumping a pointer through blocks
+// taken from kalloc. Nothing is freed on its own, instead all memory
+// handed out after a mark goes away at once with reset, and all of
+// it with release or when the arena goes out of scope.
+//
+// This suits many small allocations which die together, like the
+// temporaries of a single operation.
+//
+// KObjects created in an arena only run their destructor when their
+// last reference goes away. They must not outlive the arena.
+//
+static const size_t kArenaBlockSize = 4 * 1024 /* 4 KiB */;
+
+class Arena {
+public:
+	struct Block;
+	
+	struct Mark {
+		Block* block;
+		offset_t position;
+	};
+private:
+	size_t blockSize;
+	// The newest block, allocations are bumped from it
+	Block* blocks;
+	offset_t position;
+	offset_t limit;
+	
+	bool addBlock(size_t size);
+	
+	static void MarkCreated(KObject* object) { object->arenaAllocated = true; }
+	static void MarkCreated(void*) {}
+public:
+	constexpr Arena(size_t _blockSize = kArenaBlockSize)
+		: blockSize(_blockSize), blocks(NULL), position(0), limit(0)
+	{}
+	
+	~Arena()
+	{
+		this->release();
+	}
+	
+	//
+	// Allocates size bytes, 8 byte aligned
+	//
+	// A size of 0 is treated like 1, so the result is unique and
+	// only NULL on failure
+	//
+	// @return the memory or NULL if no block could be added
+	//
+	void* allocate(size_t size);
+	
+	//
+	// Constructs an object in the arena
+	//
+	template <class T, class... Args>
+	T* create(Args&&... args)
+	{
+		void* memory = this->allocate(sizeof(T));
+		
+		if (memory == NULL)
+			return NULL;
+		
+		T* object = ::new (memory) T(static_cast<Args&&>(args)...);
+		MarkCreated(object);
+		
+		return object;
+	}
+	
+	//
+	// Remembers the current position, to go back to it with reset
+	//
+	Mark mark() const
+	{
+		return { this->blocks, this->position };
+	}
+	
+	//
+	// Gives back everything allocated since the mark was taken
+	//
+	void reset(Mark mark);
+	
+	//
+	// Gives back all memory of the arena
+	//
+	void release()
+	{
+		this->reset({ NULL, 0 });
+	}
+};
@@ -0,0 +1,239 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "ObjectCache.h"
+
+#include "Memory/kalloc.h"
+#include "Memory/PageOwners.h"
+#include "VM/VM.h"
+#include "VM/KernelPages.h"
+#include "Error/Assert.h"
+
+// Empty slabs kept by every cache
+static const uint32_t kMaxEmptySlabs = 1;
+
+struct Slab {
+	ObjectCache* cache;
+	Slab* prev;
+	Slab* next;
+	// Linked through the first word of the free objects
+	void* freeObjects;
+	uint32_t usedObjects;
+	uint32_t objectCount;
+};
+
+static const size_t kSlabHeaderSize = (sizeof(Slab) + 0x7) & ~(size_t)0x7;
+
+// Larger object slots do not fit a slab
+static const size_t kMaxSlotSize = kPhyMemPageSize - kSlabHeaderSize;
+
+//
+// Owner of all slab pages, so free can hand
+// objects back to their cache
+//
+static void FreeSlabObject(PageOwner* owner, void* object);
+static PageOwner SlabOwner = { FreeSlabObject };
+
+static void FreeSlabObject(PageOwner*, void* object)
+{
+	ObjectCache::Free(object);
+}
+
+static inline Slab* SlabFromObject(void* object)
+{
+	return (Slab*)((offset_t)object & kPhyPageMask);
+}
+
+static inline void SlabListRemove(Slab** list, Slab* slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+	
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+static inline void SlabListInsert(Slab** list, Slab* slab)
+{
+	slab->prev = NULL;
+	slab->next = *list;
+	
+	if (slab->next)
+		slab->next->prev = slab;
+	
+	*list = slab;
+}
+
+Slab* ObjectCache::createSlab()
+{
+	Slab* slab = (Slab*)VM::SlabPages.allocate(1);
+	
+	// Idle heaps may hold the page we need
+	if (slab == NULL && VM::IsKernelContextActive() && KallocTrim() > 0)
+		slab = (Slab*)VM::SlabPages.allocate(1);
+	
+	if (slab == NULL)
+		return NULL;
+	
+	if (!PageOwnersSet(slab, kPhyMemPageSize, &SlabOwner)) {
+		VM::SlabPages.free(slab, 1);
+		return NULL;
+	}
+	
+	slab->cache = this;
+	slab->usedObjects = 0;
+	slab->objectCount = (uint32_t)(kMaxSlotSize / this->slotSize);
+	slab->freeObjects = NULL;
+	
+	assert(slab->objectCount > 0);
+	
+	// Link the objects, so the first one is handed out first
+	for (uint32_t i = slab->objectCount; i > 0; i--) {
+		void* object = OFFSET(slab, kSlabHeaderSize + (i - 1) * this->slotSize);
+		
+		if (this->constructor)
+			this->constructor(object);
+		
+		*this->link(object) = slab->freeObjects;
+		slab->freeObjects = object;
+	}
+	
+	return slab;
+}
+
+//
+// Allocates an object from kalloc, when no slab can be used
+//
+void* ObjectCache::allocateFallback(size_t size, const void* caller)
+{
+	void* object = kalloc_caller(size, caller);
+	
+	if (object != NULL && this->constructor)
+		this->constructor(object);
+	
+	return object;
+}
+
+void* ObjectCache::allocate(size_t size)
+{
+	return this->allocate(size, __builtin_return_address(0));
+}
+
+void* ObjectCache::allocate(size_t size, const void* caller)
+{
+	if (size > this->objectSize || this->slotSize > kMaxSlotSize)
+		return this->allocateFallback(size, caller);
+	
+	uint32_t interrupts = SpinlockLockSave(&this->lock);
+	Slab* slab = this->partialSlabs;
+	
+	if (slab == NULL) {
+		// Reuse an empty slab before asking for a new page
+		if (this->emptySlabs) {
+			slab = this->emptySlabs;
+			SlabListRemove(&this->emptySlabs, slab);
+			this->emptySlabCount--;
+		}
+		else {
+			// Getting a page may take long, others can go on meanwhile
+			SpinlockUnlockRestore(&this->lock, interrupts);
+			
+			if ((slab = this->createSlab()) == NULL)
+				return this->allocateFallback(size, caller);
+			
+			interrupts = SpinlockLockSave(&this->lock);
+		}
+		
+		SlabListInsert(&this->partialSlabs, slab);
+	}
+	
+	void* object = slab->freeObjects;
+	slab->freeObjects = *this->link(object);
+	slab->usedObjects++;
+	this->objectCount++;
+	
+	if (slab->usedObjects == slab->objectCount) {
+		SlabListRemove(&this->partialSlabs, slab);
+		SlabListInsert(&this->fullSlabs, slab);
+	}
+	
+	SpinlockUnlockRestore(&this->lock, interrupts);
+	
+	return object;
+}
+
+Slab* ObjectCache::freeObject(Slab* slab, void* object)
+{
+	assert(slab->usedObjects > 0);
+	
+	if (slab->usedObjects == slab->objectCount) {
+		SlabListRemove(&this->fullSlabs, slab);
+		SlabListInsert(&this->partialSlabs, slab);
+	}
+	
+	*this->link(object) = slab->freeObjects;
+	slab->freeObjects = object;
+	slab->usedObjects--;
+	this->objectCount--;
+	
+	if (slab->usedObjects == 0) {
+		SlabListRemove(&this->partialSlabs, slab);
+		
+		if (this->emptySlabCount < kMaxEmptySlabs) {
+			SlabListInsert(&this->emptySlabs, slab);
+			this->emptySlabCount++;
+		}
+		else {
+			return slab;
+		}
+	}
+	
+	return NULL;
+}
+
+void ObjectCache::Free(void* object)
+{
+	if (object == NULL)
+		return;
+	
+	// Objects from the kalloc fallback
+	if (PageOwnersGet(object) != &SlabOwner) {
+		free(object);
+		return;
+	}
+	
+	Slab* slab = SlabFromObject(object);
+	ObjectCache* cache = slab->cache;
+	
+	uint32_t interrupts = SpinlockLockSave(&cache->lock);
+	Slab* unused = cache->freeObject(slab, object);
+	SpinlockUnlockRestore(&cache->lock, interrupts);
+	
+	if (unused) {
+		PageOwnersClear(unused, kPhyMemPageSize);
+		VM::SlabPages.free(unused, 1);
+	}
+}
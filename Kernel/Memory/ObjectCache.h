@@ -0,0 +1,124 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <CoreSystem/CommonTypes.h>
+#include "Utils/Spinlock.h"
+
+//
+// Object caches
+// =============
+//
+// An ObjectCache hands out objects of one size from page sized
+// slabs. Every slab starts with a header followed by its objects,
+// free objects are linked through their first word.
+//
+// Slabs are kept on three lists: partial slabs are used first,
+// full slabs are put aside until an object is freed and a few
+// empty slabs are kept, so churning objects never needs new pages.
+//
+// Until slabs can be mapped, for requests larger than the object
+// size and for objects which do not fit into a slab, the cache
+// falls back to kalloc.
+//
+// A cache can be given a constructor, which brings an object into
+// its initial state once, when its slab is made. Objects have to
+// be back in that state when they are freed, so allocating one
+// again needs no initialization. The free list of such a cache
+// is linked through a word behind every object instead of its
+// first word, so the constructed state survives.
+//
+// Caches are shared by all cpus. Their slab lists and the free
+// lists of their slabs are only touched with the cache locked.
+// Slabs are made and given back without the lock.
+//
+struct Slab;
+
+typedef void (*ObjectCacheConstructor)(void* object);
+
+class ObjectCache {
+private:
+	const char* name;
+	size_t objectSize;
+	ObjectCacheConstructor constructor;
+	// Where the free list link lives inside an object slot
+	size_t linkOffset;
+	// Distance between two objects in a slab
+	size_t slotSize;
+	
+	Slab* partialSlabs;
+	Slab* fullSlabs;
+	Slab* emptySlabs;
+	uint32_t emptySlabCount;
+	
+	// Objects handed out from slabs
+	uint32_t objectCount;
+	
+	Spinlock lock;
+	
+	Slab* createSlab();
+	void* allocateFallback(size_t size, const void* caller);
+	
+	//
+	// Puts the object back into its slab, the cache has to be locked
+	//
+	// @return the slab when it is no longer needed and has to be
+	//         given back once the lock is dropped, otherwise NULL
+	//
+	Slab* freeObject(Slab* slab, void* object);
+	
+	void** link(void* object) const
+	{
+		return (void**)OFFSET(object, this->linkOffset);
+	}
+public:
+	constexpr ObjectCache(const char* _name, size_t _objectSize, ObjectCacheConstructor _constructor = NULL)
+		: name(_name), objectSize((_objectSize + 0x7) & ~(size_t)0x7),
+		  constructor(_constructor),
+		  linkOffset(_constructor ? (_objectSize + 0x7) & ~(size_t)0x7 : 0),
+		  slotSize(((_objectSize + 0x7) & ~(size_t)0x7) + (_constructor ? 0x8 : 0)),
+		  partialSlabs(NULL), fullSlabs(NULL), emptySlabs(NULL),
+		  emptySlabCount(0), objectCount(0), lock(0)
+	{}
+	
+	//
+	// Allocates an object of at least size bytes
+	//
+	void* allocate(size_t size);
+	
+	//
+	// Same as allocate, but kalloc accounts fallback
+	// allocations to caller
+	//
+	void* allocate(size_t size, const void* caller);
+	
+	//
+	// Frees an object allocated by any ObjectCache
+	//
+	static void Free(void* object);
+	
+	const char* getName() const { return this->name; }
+	uint32_t getObjectCount() const { return this->objectCount; }
+};
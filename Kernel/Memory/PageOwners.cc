@@ -0,0 +1,128 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "PageOwners.h"
+
+#include "VM/VM.h"
+#include "VM/KernelPages.h"
+
+static const uint32_t kPageShift = 12;
+static const uint32_t kLeafShift = 22;
+static const uint32_t kLeafEntries = 1024;
+static const uint32_t kDirectoryEntries = 1024;
+
+static PageOwner** Directory[kDirectoryEntries];
+
+//
+// The leaves needed before the kernel context is active, when
+// the startup heap is added
+//
+static const uint32_t kBootLeafCount = 2;
+static PageOwner* BootLeaves[kBootLeafCount][kLeafEntries];
+static uint32_t BootLeavesUsed;
+
+static PageOwner** GetLeaf(offset_t address, bool create)
+{
+	uint32_t index = (uint32_t)(address >> kLeafShift);
+	PageOwner** leaf = Directory[index];
+	
+	if (leaf != NULL || !create)
+		return leaf;
+	
+	if (VM::IsKernelContextActive()) {
+		leaf = (PageOwner**)VM::OwnerMapPages.allocate(1, true);
+		
+		if (leaf == NULL)
+			return NULL;
+	}
+	else {
+		uint32_t boot = __sync_fetch_and_add(&BootLeavesUsed, 1);
+		
+		if (boot >= kBootLeafCount)
+			return NULL;
+		
+		leaf = BootLeaves[boot];
+	}
+	
+	// Someone else may have made the leaf meanwhile
+	if (!__sync_bool_compare_and_swap(&Directory[index], NULL, leaf)) {
+		if (VM::OwnerMapPages.contains(leaf))
+			VM::OwnerMapPages.free(leaf, 1);
+		
+		leaf = Directory[index];
+	}
+	
+	return leaf;
+}
+
+//
+// Number of pages touched by size bytes at address
+//
+static inline size_t PageCount(pointer_t address, size_t size)
+{
+	if (size == 0)
+		return 0;
+	
+	return (((offset_t)address + size - 1) >> kPageShift) - ((offset_t)address >> kPageShift) + 1;
+}
+
+bool PageOwnersSet(pointer_t address, size_t size, PageOwner* owner)
+{
+	offset_t page = (offset_t)address & kPhyPageMask;
+	size_t count = PageCount(address, size);
+	
+	for (size_t i = 0; i < count; i++, page += kPhyMemPageSize) {
+		PageOwner** leaf = GetLeaf(page, true);
+		
+		if (leaf == NULL)
+			return false;
+		
+		leaf[(page >> kPageShift) & (kLeafEntries - 1)] = owner;
+	}
+	
+	return true;
+}
+
+void PageOwnersClear(pointer_t address, size_t size)
+{
+	offset_t page = (offset_t)address & kPhyPageMask;
+	size_t count = PageCount(address, size);
+	
+	for (size_t i = 0; i < count; i++, page += kPhyMemPageSize) {
+		PageOwner** leaf = GetLeaf(page, false);
+		
+		if (leaf)
+			leaf[(page >> kPageShift) & (kLeafEntries - 1)] = NULL;
+	}
+}
+
+PageOwner* PageOwnersGet(pointer_t address)
+{
+	PageOwner** leaf = GetLeaf((offset_t)address, false);
+	
+	if (leaf == NULL)
+		return NULL;
+	
+	return leaf[((offset_t)address >> kPageShift) & (kLeafEntries - 1)];
+}
@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <CoreSystem/CommonTypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Page owners
+// ===========
+//
+// The page owner map tells which allocator a page belongs to, so
+// memory can be given back without searching the heaps. It is a two
+// level table keyed by the virtual page number, the leaves are made
+// the first time a page of their 4 MiB gets an owner.
+//
+// A page can only have one owner, heaps added by hand must not share
+// pages with each other.
+//
+typedef struct PageOwner PageOwner;
+struct PageOwner {
+	// Gives an allocation back to its owner
+	void (*free)(PageOwner* owner, void* ptr);
+};
+
+//
+// Sets the owner of all pages touched by size bytes at address
+//
+// @return false if the map could not grow to cover the pages
+//
+bool PageOwnersSet(pointer_t address, size_t size, PageOwner* owner);
+
+//
+// Clears the owner of all pages touched by size bytes at address
+//
+void PageOwnersClear(pointer_t address, size_t size);
+
+//
+// Gets the owner of the page containing address
+//
+// @return the owner or NULL if the page has none
+//
+PageOwner* PageOwnersGet(pointer_t address);
+
+#ifdef __cplusplus
+}
+#endif
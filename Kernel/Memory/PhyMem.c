@@ -21,53 +21,531 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
-
 #include "PhyMem.h"
 
+#include "Error/Assert.h"
 #include "Logging/Logging.h"
+#include "Utils/CPU.h"
+#include "Utils/Bits.h"
+#include "Utils/Spinlock.h"
+
+#include <CoreSystem/MachineInstructions.h>
 
 static const uint32_t kPageMask = ~(kPhyMemPageSize - 1);
-static const uint32_t kFreeBitmapPlanes = 4ULL*1024ULL*1024ULL*1024ULL /* 4GB */ / kPhyMemPageSize /* Page size */ / 32 /* 32 pages per 32bit uint_t value */;
-static uint32_t FreeBitmap[kFreeBitmapPlanes];
+static const uint32_t kPageShift = 12;
+// The page count is rounded to this, so every order has whole planes
+static const uint32_t kPageCountGranularity = 32 << kPhyMemMaxOrder;
+
+//
+// Block bitmaps
+// =============
+//
+// For every order n there is a bitmap with one bit per naturally
+// aligned block of 2^n pages. The bit is set when the whole block
+// is free. Order 0 is the plain page bitmap.
+//
+// This forms a buddy system: a block is free exactly when both
+// of its buddies one order below are free. Splitting and merging
+// therefore happens implicitly, by recomputing one word per order
+// whenever pages change their state.
+//
+// Every bitmap has two summary levels. summary holds one bit per
+// plane which is set when the plane has at least one free block,
+// summaryTop does the same for every word of summary.
+//
+// So finding a free block only needs to look at the few words of
+// summaryTop and then follow the first set bit down two levels,
+// regardless of how fragmented the bitmap is.
+//
+typedef struct {
+	uint32_t* planes;
+	uint32_t* summary;
+	uint32_t* summaryTop;
+	uint32_t planeCount;
+	uint32_t summaryCount;
+	uint32_t summaryTopCount;
+} BlockBitmap;
+
+static BlockBitmap Orders[kPhyMemMaxOrder + 1];
+
+//
+// The bitmaps only cover the pages up to the top of memory and
+// are placed by the caller of PhyMemInitialize.
+//
+static uint32_t PageCount;
+static page_t BitmapFirstPage;
+static uint32_t BitmapPageCount;
+
+//
+// Per cpu magazines of free pages. Pages inside a magazine
+// are marked used in the block bitmaps.
+//
+// A magazine is only touched with interrupts disabled and its
+// lock held. The lock is almost always taken by its own cpu,
+// others only take it to drain the magazine when they run out
+// of pages. The bitmaps lock may be taken while holding a
+// magazine lock, never the other way round.
+//
+typedef struct {
+	page_t pages[kPhyMemMagazineSize];
+	uint32_t count;
+	uint32_t hits;
+	uint32_t misses;
+	uint64_t allocatedPages;
+	uint64_t freedPages;
+	Spinlock lock;
+} Magazine;
+
+static Magazine Magazines[kCPUMaxCount];
+
+//
+// The block bitmaps, zones and counters below are shared
+// by all cpus and only touched with this lock held
+//
+static Spinlock BitmapsLock;
+
+//
+// Pages handed out and taken back through the public
+// allocation functions, since initialization. Pages going
+// through the magazines are counted in the magazines.
+//
+static uint64_t AllocatedPages;
+static uint64_t FreedPages;
+static uint32_t MagazineLowWatermark = 16;
+static uint32_t MagazineHighWatermark = 48;
+
+//
+// Zones
+// =====
+//
+// Zones split the pages by address. Their bounds are aligned to the
+// largest block, so no block ever spans two zones.
+//
+typedef struct {
+	// First page of the zone
+	uint32_t firstPage;
+	// First page after the zone
+	uint32_t endPage;
+	// Pages reported as available by the bootloader
+	uint32_t presentPages;
+	// Pages currently free in the bitmaps
+	uint32_t freePages;
+} Zone;
+
+static Zone Zones[kPhyMemZoneCount];
+
+//
+// The order in which zones are tried for a requested zone.
+// Allocations never fall back to a zone above the requested one,
+// as the caller may not be able to use its pages.
+//
+static const PhyMemZone ZoneFallbacks[kPhyMemZoneCount][kPhyMemZoneCount] = {
+	[kPhyMemZoneDMA]    = { kPhyMemZoneDMA, kPhyMemZoneCount },
+	[kPhyMemZoneNormal] = { kPhyMemZoneNormal, kPhyMemZoneDMA, kPhyMemZoneCount },
+	[kPhyMemZoneHigh]   = { kPhyMemZoneHigh, kPhyMemZoneNormal, kPhyMemZoneDMA }
+};
+
+//
+// Page frame database
+// ===================
+//
+// The frames are reserved before the vm subsystem is up, but
+// can only be used once it mapped them.
+//
+static PhyMemFrame* FrameDatabase;
+static uint32_t FrameCount;
+static page_t FrameDatabaseFirstPage;
+static uint32_t FrameDatabasePageCount;
+
+// Zone used when the caller does not care
+static const PhyMemZone kDefaultZone = kPhyMemZoneHigh;
+
+static inline uint32_t LockBitmaps()
+{
+	return SpinlockLockSave(&BitmapsLock);
+}
+
+static inline void UnlockBitmaps(uint32_t interrupts)
+{
+	SpinlockUnlockRestore(&BitmapsLock, interrupts);
+}
+
+//
+// Magazine locks, interrupts have to be disabled by the caller
+//
+static inline void LockMagazine(Magazine* magazine)
+{
+	SpinlockLock(&magazine->lock);
+}
+
+static inline void UnlockMagazine(Magazine* magazine)
+{
+	SpinlockUnlock(&magazine->lock);
+}
 
 static inline uint32_t PageNumberFromAddress(pointer_t address)
 {
 	return (uint32_t)address/kPhyMemPageSize;
 }
 
-static inline uint32_t PlaneNumberFromAddress(pointer_t address)
+static inline pointer_t AddressFromPageNumber(uint32_t pageNumber)
+{
+	return (pointer_t)(pageNumber * kPhyMemPageSize);
+}
+
+static inline uint32_t CountBits(uint32_t value)
+{
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	value = (value + (value >> 4)) & 0x0F0F0F0F;
+	
+	return (value * 0x01010101) >> 24;
+}
+
+static inline Zone* ZoneFromPageNumber(uint32_t pageNumber)
+{
+	for (uint32_t i = 0; i < kPhyMemZoneCount; i++) {
+		if (pageNumber < Zones[i].endPage)
+			return &Zones[i];
+	}
+	
+	return &Zones[kPhyMemZoneCount - 1];
+}
+
+//
+// Folds every pair of bits into one bit which is only set when
+// both bits of the pair were set. The result uses the lower 16 bits.
+//
+static inline uint32_t CompressPairs(uint32_t value)
+{
+	value = value & (value >> 1) & 0x55555555;
+	value = (value | (value >> 1)) & 0x33333333;
+	value = (value | (value >> 2)) & 0x0F0F0F0F;
+	value = (value | (value >> 4)) & 0x00FF00FF;
+	value = (value | (value >> 8)) & 0x0000FFFF;
+	
+	return value;
+}
+
+//
+// Stores a new value for a plane and keeps the summary
+// levels in sync with it.
+//
+// @returns true if the plane changed
+//
+static inline bool BitmapSetPlane(BlockBitmap* bitmap, uint32_t planeNumber, uint32_t value)
+{
+	uint32_t summaryNumber = planeNumber >> 5;
+	uint32_t oldValue = bitmap->planes[planeNumber];
+	
+	if (oldValue == value)
+		return false;
+	
+	bitmap->planes[planeNumber] = value;
+	
+	// Only transitions between empty and non empty
+	// are of interest for the summary
+	if ((oldValue == 0) == (value == 0))
+		return true;
+	
+	if (value != 0) {
+		if (bitmap->summary[summaryNumber] == 0)
+			bitmap->summaryTop[summaryNumber >> 5] |= 1U << (summaryNumber & 0x1F);
+		
+		bitmap->summary[summaryNumber] |= 1U << (planeNumber & 0x1F);
+	}
+	else {
+		bitmap->summary[summaryNumber] &= ~(1U << (planeNumber & 0x1F));
+		
+		if (bitmap->summary[summaryNumber] == 0)
+			bitmap->summaryTop[summaryNumber >> 5] &= ~(1U << (summaryNumber & 0x1F));
+	}
+	
+	return true;
+}
+
+//
+// Finds the first plane at or after startPlane which has
+// a free block by walking the summary levels.
+//
+static bool BitmapNextPlane(BlockBitmap* bitmap, uint32_t startPlane, uint32_t* planeNumber)
+{
+	uint32_t summaryNumber = startPlane >> 5;
+	
+	if (summaryNumber >= bitmap->summaryCount)
+		return false;
+	
+	// First look at the rest of the summary word of startPlane
+	uint32_t value = bitmap->summary[summaryNumber] & (kUInt32Max << (startPlane & 0x1F));
+	
+	if (value == 0) {
+		// Then go up to the top level for the following summary words
+		summaryNumber++;
+		
+		uint32_t topIndex = summaryNumber >> 5;
+		
+		if (topIndex >= bitmap->summaryTopCount)
+			return false;
+		
+		value = bitmap->summaryTop[topIndex] & (kUInt32Max << (summaryNumber & 0x1F));
+		
+		while (value == 0) {
+			// No plane below this word has a free block, so proceed.
+			if (++topIndex >= bitmap->summaryTopCount)
+				return false;
+			
+			value = bitmap->summaryTop[topIndex];
+		}
+		
+		summaryNumber = (topIndex << 5) | FirstSetBit(value);
+		value = bitmap->summary[summaryNumber];
+	}
+	
+	/*
+	 The summary bit is only set for planes which are not 0, so there must be at least
+	 one bit set in this plane. =)
+	*/
+	*planeNumber = (summaryNumber << 5) | FirstSetBit(value);
+	
+	return true;
+}
+
+//
+// Finds the first free block in a bitmap between
+// firstBlock and endBlock (exclusive).
+//
+static bool BitmapFindFirst(BlockBitmap* bitmap, uint32_t firstBlock, uint32_t endBlock, uint32_t* block)
+{
+	uint32_t planeNumber = firstBlock >> 5;
+	
+	while (BitmapNextPlane(bitmap, planeNumber, &planeNumber)) {
+		uint32_t value = bitmap->planes[planeNumber];
+		
+		if (planeNumber << 5 >= endBlock)
+			return false;
+		
+		// Mask the blocks outside of the range
+		if (planeNumber == firstBlock >> 5)
+			value &= kUInt32Max << (firstBlock & 0x1F);
+		if (planeNumber == (endBlock - 1) >> 5)
+			value &= kUInt32Max >> (31 - ((endBlock - 1) & 0x1F));
+		
+		if (value != 0) {
+			*block = (planeNumber << 5) | FirstSetBit(value);
+			
+			return true;
+		}
+		
+		planeNumber++;
+	}
+	
+	return false;
+}
+
+//
+// Finds a free block of the order for a zone, trying
+// the fallback zones in order.
+//
+static bool FindFreeBlock(uint8_t order, PhyMemZone zone, uint32_t* block)
 {
-	return PageNumberFromAddress(address) >> 5;
+	for (const PhyMemZone* z = ZoneFallbacks[zone]; z < ZoneFallbacks[zone] + kPhyMemZoneCount && *z != kPhyMemZoneCount; z++) {
+		// Empty zones need no lookup
+		if (Zones[*z].freePages < (1U << order))
+			continue;
+		
+		if (BitmapFindFirst(&Orders[order], Zones[*z].firstPage >> order, Zones[*z].endPage >> order, block))
+			return true;
+	}
+	
+	return false;
 }
 
-static inline uint32_t BitNumberInPlaneFromAddress(pointer_t address)
+//
+// Stores a new value for a plane of the page bitmap
+// and updates the free page counter of its zone.
+//
+static inline void SetPagePlane(uint32_t planeNumber, uint32_t value)
 {
-	return PageNumberFromAddress(address) & 0x1F;
+	Zone* zone = ZoneFromPageNumber(planeNumber << 5);
+	
+	zone->freePages -= CountBits(Orders[0].planes[planeNumber]);
+	zone->freePages += CountBits(value);
+	
+	BitmapSetPlane(&Orders[0], planeNumber, value);
 }
 
-static inline pointer_t AddressFromPlaneAndBit(uint32_t planeNumber, uint32_t bitNumber)
+//
+// Recomputes all orders above 0 for the blocks covering
+// the pages firstPage to lastPage (inclusive).
+//
+static void UpdateOrders(uint32_t firstPage, uint32_t lastPage)
 {
-	return (pointer_t)(((planeNumber << 5) | bitNumber) * kPhyMemPageSize);
+	for (uint8_t order = 1; order <= kPhyMemMaxOrder; order++) {
+		BlockBitmap* lower = &Orders[order - 1];
+		BlockBitmap* bitmap = &Orders[order];
+		bool changed = false;
+		
+		for (uint32_t planeNumber = (firstPage >> order) >> 5;
+		     planeNumber <= (lastPage >> order) >> 5;
+		     planeNumber++) {
+			uint32_t value = CompressPairs(lower->planes[planeNumber * 2]) 
+			               | CompressPairs(lower->planes[planeNumber * 2 + 1]) << 16;
+			
+			if (BitmapSetPlane(bitmap, planeNumber, value))
+				changed = true;
+		}
+		
+		// Nothing changed at this order, so nothing above will either
+		if (!changed)
+			break;
+	}
 }
 
-void PhyMemInitialize()
+//
+// Marks pageCount pages starting at firstPage free or used. Whole
+// planes are written at once, only the edges need masking.
+//
+static void SetPages(uint32_t firstPage, uint32_t pageCount, bool free)
+{
+	if (firstPage >= PageCount || pageCount == 0)
+		return;
+	
+	uint32_t lastPage = firstPage + (pageCount - 1);
+	
+	// Clamp to the top of memory
+	if (lastPage >= PageCount || lastPage < firstPage)
+		lastPage = PageCount - 1;
+	
+	for (uint32_t planeNumber = firstPage >> 5; planeNumber <= lastPage >> 5; planeNumber++) {
+		uint32_t mask = kUInt32Max;
+		uint32_t value = Orders[0].planes[planeNumber];
+		
+		if (planeNumber == firstPage >> 5)
+			mask &= kUInt32Max << (firstPage & 0x1F);
+		if (planeNumber == lastPage >> 5)
+			mask &= kUInt32Max >> (31 - (lastPage & 0x1F));
+		
+		if (free)
+			value |= mask;
+		else
+			value &= ~mask;
+		
+		SetPagePlane(planeNumber, value);
+	}
+	
+	UpdateOrders(firstPage, lastPage);
+}
+
+//
+// Rounds the number of pages up to whole planes of every order
+//
+static inline uint32_t RoundPageCount(uint32_t pageCount)
+{
+	if (pageCount > kUInt32Max - kPageCountGranularity)
+		return (uint32_t)(4ULL*1024ULL*1024ULL*1024ULL /* 4GB */ / kPhyMemPageSize);
+	
+	return (pageCount + kPageCountGranularity - 1) & ~(kPageCountGranularity - 1);
+}
+
+static inline uint32_t Min(uint32_t a, uint32_t b)
+{
+	return a < b ? a : b;
+}
+
+size_t PhyMemGetBitmapSize(uint32_t pageCount)
+{
+	uint32_t planeCount = RoundPageCount(pageCount) / 32;
+	uint32_t words = 0;
+	
+	for (uint8_t order = 0; order <= kPhyMemMaxOrder; order++) {
+		uint32_t orderPlanes = planeCount >> order;
+		uint32_t summaryCount = (orderPlanes + 31) / 32;
+		
+		words += orderPlanes + summaryCount + (summaryCount + 31) / 32;
+	}
+	
+	return (words * sizeof(uint32_t) + kPhyMemPageSize - 1) & kPageMask;
+}
+
+void PhyMemInitialize(uint32_t pageCount, pointer_t bitmap, page_t bitmapPage)
 {
 	CurrentLogLovel = kLogLevelInfo;
 	
+	PageCount = RoundPageCount(pageCount);
+	BitmapFirstPage = bitmapPage;
+	BitmapPageCount = PhyMemGetBitmapSize(pageCount) >> kPageShift;
+	
+	// Carve the bitmaps of all orders out of the storage
+	uint32_t* storage = bitmap;
+	for (uint8_t order = 0; order <= kPhyMemMaxOrder; order++) {
+		BlockBitmap* orderBitmap = &Orders[order];
+		
+		orderBitmap->planeCount = (PageCount / 32) >> order;
+		orderBitmap->summaryCount = (orderBitmap->planeCount + 31) / 32;
+		orderBitmap->summaryTopCount = (orderBitmap->summaryCount + 31) / 32;
+		
+		orderBitmap->planes = storage;
+		storage += orderBitmap->planeCount;
+		orderBitmap->summary = storage;
+		storage += orderBitmap->summaryCount;
+		orderBitmap->summaryTop = storage;
+		storage += orderBitmap->summaryTopCount;
+	}
+	
 	// Nothing is free
-	for (uint32_t i = 0; i < kFreeBitmapPlanes; i++)
-		FreeBitmap[i] = 0;
+	for (uint32_t* word = bitmap; word < storage; word++)
+		*word = 0;
+	
+	for (uint32_t i = 0; i < kPhyMemZoneCount; i++) {
+		Zones[i].presentPages = 0;
+		Zones[i].freePages = 0;
+	}
+	Zones[kPhyMemZoneDMA].firstPage = 0;
+	Zones[kPhyMemZoneDMA].endPage = Min((16 * 1024 * 1024) >> kPageShift, PageCount);
+	Zones[kPhyMemZoneNormal].firstPage = Zones[kPhyMemZoneDMA].endPage;
+	Zones[kPhyMemZoneNormal].endPage = Min((896 * 1024 * 1024) >> kPageShift, PageCount);
+	Zones[kPhyMemZoneHigh].firstPage = Zones[kPhyMemZoneNormal].endPage;
+	Zones[kPhyMemZoneHigh].endPage = PageCount;
+	
+	for (uint32_t i = 0; i < kCPUMaxCount; i++) {
+		Magazines[i].count = 0;
+		Magazines[i].hits = 0;
+		Magazines[i].misses = 0;
+		Magazines[i].allocatedPages = 0;
+		Magazines[i].freedPages = 0;
+		Magazines[i].lock = 0;
+	}
+	
+	AllocatedPages = 0;
+	FreedPages = 0;
 	
-	LogInfo("PhyMem initialized");
+	FrameDatabase = NULL;
+	FrameCount = 0;
+	FrameDatabaseFirstPage = kPhyInvalidPage;
+	FrameDatabasePageCount = 0;
+	
+	LogInfo("PhyMem initialized for %d pages", PageCount);
+}
+
+void PhyMemGetBitmapPages(page_t* firstPage, size_t* numberOfPages)
+{
+	*firstPage = BitmapFirstPage;
+	*numberOfPages = BitmapPageCount;
 }
 
 void LogPhyMem()
 {
-	for (uint32_t i = 0; i < kFreeBitmapPlanes; i++) {
+	uint32_t* planes = Orders[0].planes;
+	PhyMemStatistics statistics;
+	
+	PhyMemGetStatistics(&statistics);
+	LogInfo("PhyMem: %d of %d pages free, largest free block %d pages", statistics.freePages, statistics.totalPages, statistics.largestFreeBlock);
+	
+	for (uint32_t i = 0; i < Orders[0].planeCount; i++) {
 		char f[33];
 		
 		for (uint8_t j = 0; j < 32; j++)
-			f[j] = (FreeBitmap[i]&(1 << j)) ? 'F' : '_';
+			f[j] = (planes[i]&(1U << j)) ? 'F' : '_';
 		
 		f[32] = '\0';
 		
@@ -76,7 +554,7 @@ void LogPhyMem()
 		// Collapse uniform
 		{
 			uint32_t j = i+1;
-			for (; j < kFreeBitmapPlanes && FreeBitmap[i] == FreeBitmap[j]; j++);
+			for (; j < Orders[0].planeCount && planes[i] == planes[j]; j++);
 			
 			// Collapse 5 consequend rows
 			if (j - i >= 3) {
@@ -89,79 +567,604 @@ void LogPhyMem()
 
 void _PhyMemMarkFree(pointer_t page)
 {
-	uint32_t planeNumber = PlaneNumberFromAddress(page);
+	uint32_t interrupts = LockBitmaps();
+	
+	SetPages(PageNumberFromAddress(page), 1, true);
+	
+	UnlockBitmaps(interrupts);
+}
+
+void _PhyMemMarkUsed(pointer_t page)
+{
+	uint32_t interrupts = LockBitmaps();
+	
+	SetPages(PageNumberFromAddress(page), 1, false);
+	
+	UnlockBitmaps(interrupts);
+}
 
-	if (planeNumber > kFreeBitmapPlanes)
+void _PhyMemMarkUsedRange(pointer_t address, size_t size)
+{
+	if (size == 0)
 		return;
+	
+	// Every page touched by the range is used
+	uint64_t firstPage = (uint32_t)address >> kPageShift;
+	uint64_t lastPage = ((uint64_t)(uint32_t)address + size - 1) >> kPageShift;
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	SetPages((uint32_t)firstPage, (uint32_t)(lastPage - firstPage + 1), false);
+	
+	UnlockBitmaps(interrupts);
+}
 
-	FreeBitmap[planeNumber] |= 1 << BitNumberInPlaneFromAddress(page);
+void _PhyMemMarkFreeRange(page_t address, size_t size)
+{
+	// Only pages completely inside the range are free
+	uint64_t firstPage = ((uint64_t)(uint32_t)address + kPhyMemPageSize - 1) >> kPageShift;
+	uint64_t endPage = ((uint64_t)(uint32_t)address + size) >> kPageShift;
+	
+	if (endPage <= firstPage)
+		return;
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	SetPages((uint32_t)firstPage, (uint32_t)(endPage - firstPage), true);
+	
+	UnlockBitmaps(interrupts);
 }
 
-void _PhyMemMarkUsed(pointer_t page)
+void _PhyMemAddAvailableRange(page_t address, size_t size)
 {
-	uint32_t planeNumber = PlaneNumberFromAddress(page);
+	uint64_t firstPage = ((uint64_t)(uint32_t)address + kPhyMemPageSize - 1) >> kPageShift;
+	uint64_t endPage = ((uint64_t)(uint32_t)address + size) >> kPageShift;
+	
+	if (endPage <= firstPage)
+		return;
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	for (uint32_t i = 0; i < kPhyMemZoneCount; i++) {
+		uint64_t first = firstPage > Zones[i].firstPage ? firstPage : Zones[i].firstPage;
+		uint64_t end = endPage < Zones[i].endPage ? endPage : Zones[i].endPage;
+		
+		if (end > first)
+			Zones[i].presentPages += (uint32_t)(end - first);
+	}
+	
+	SetPages((uint32_t)firstPage, (uint32_t)(endPage - firstPage), true);
+	
+	UnlockBitmaps(interrupts);
+}
 
-	if (planeNumber > kFreeBitmapPlanes)
+//
+// Resets the flags of freed pages, so the next owner starts
+// without stale state. The map count is left alone, it only
+// changes with the mappings.
+//
+static inline void ClearFrames(uint32_t firstPage, uint32_t pageCount)
+{
+	if (FrameDatabase == NULL || firstPage >= FrameCount)
 		return;
+	
+	if (pageCount > FrameCount - firstPage)
+		pageCount = FrameCount - firstPage;
+	
+	for (uint32_t i = firstPage; i < firstPage + pageCount; i++)
+		FrameDatabase[i].flags = 0;
+}
 
-	FreeBitmap[planeNumber] &= ~(1 << BitNumberInPlaneFromAddress(page));
+//
+// Allocates a block directly from the block bitmaps
+//
+static bool AllocBlock(uint32_t* page, uint8_t order, PhyMemZone zone)
+{
+	uint32_t block;
+	
+	if (!FindFreeBlock(order, zone, &block))
+		return false;
+	
+	*page = block << order;
+	
+	// Mark it as used, this splits every larger block
+	// containing it
+	SetPages(*page, 1U << order, false);
+	
+	return true;
 }
 
-void _PhyMemMarkUsedRange(pointer_t address, size_t size)
+//
+// Moves pages from the magazine back to the block bitmaps
+// until only count pages are left. The magazine has to be
+// locked.
+//
+static void DrainMagazine(Magazine* magazine, uint32_t count)
 {
-	for(uint32_t addr = ((uint32_t)address & kPageMask); 
-	    addr < (uint32_t)address + size;
-		addr += kPhyMemPageSize) {
-		_PhyMemMarkUsed((pointer_t)addr);
+	if (magazine->count <= count)
+		return;
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	while (magazine->count > count) {
+		magazine->count--;
+		SetPages(PageNumberFromAddress(magazine->pages[magazine->count]), 1, true);
 	}
+	
+	UnlockBitmaps(interrupts);
 }
 
-void _PhyMemMarkFreeRange(page_t address, size_t size)
+//
+// Empties the magazines and zeroed pools of all cpus. Must not
+// be called with a magazine or pool locked.
+//
+static void DrainAllMagazines()
 {
-	for(uint32_t addr = ((uint32_t)address & kPageMask); 
-	    addr < (uint32_t)address + size;
-		addr += kPhyMemPageSize) {
-		_PhyMemMarkFree((pointer_t)addr);
+	PhyMemDrainZeroedPools();
+	
+	for (uint32_t i = 0; i < kCPUMaxCount; i++) {
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		
+		LockMagazine(&Magazines[i]);
+		DrainMagazine(&Magazines[i], 0);
+		UnlockMagazine(&Magazines[i]);
+		
+		RestoreInterrupts(interrupts);
 	}
 }
 
-bool PhyMemAlloc(pointer_t* address)
+void PhyMemSetMagazineWatermarks(uint32_t low, uint32_t high)
 {
-	uint32_t planeIndex;
+	assert(low < high && high <= kPhyMemMagazineSize);
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	MagazineLowWatermark = low;
+	MagazineHighWatermark = high;
+	
+	UnlockBitmaps(interrupts);
+}
+
+void PhyMemGetMagazineStatistics(uint32_t cpu, PhyMemMagazineStatistics* statistics)
+{
+	assert(cpu < kCPUMaxCount);
+	
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	
+	LockMagazine(&Magazines[cpu]);
+	statistics->count = Magazines[cpu].count;
+	statistics->hits = Magazines[cpu].hits;
+	statistics->misses = Magazines[cpu].misses;
+	UnlockMagazine(&Magazines[cpu]);
+	
+	RestoreInterrupts(interrupts);
+}
 
+uint32_t PhyMemGetZoneFreePages(PhyMemZone zone)
+{
+	assert(zone < kPhyMemZoneCount);
+	
+	return Zones[zone].freePages;
+}
+
+uint32_t PhyMemGetZonePresentPages(PhyMemZone zone)
+{
+	assert(zone < kPhyMemZoneCount);
+	
+	return Zones[zone].presentPages;
+}
+
+bool PhyMemIsLow()
+{
+	uint32_t freePages = 0;
+	
+	// Only a hint, so no need to lock the bitmaps
+	for (uint32_t i = 0; i < kPhyMemZoneCount; i++)
+		freePages += Zones[i].freePages;
+	
+	return freePages < kPhyMemReservePages;
+}
+
+void PhyMemGetStatistics(PhyMemStatistics* statistics)
+{
+	statistics->totalPages = 0;
+	statistics->freePages = 0;
+	statistics->magazinePages = 0;
+	statistics->zeroedPoolPages = PhyMemGetZeroedPoolPages();
+	statistics->largestFreeBlock = 0;
+	statistics->allocatedPages = 0;
+	statistics->freedPages = 0;
+	
+	for (uint32_t i = 0; i < kCPUMaxCount; i++) {
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		
+		LockMagazine(&Magazines[i]);
+		statistics->magazinePages += Magazines[i].count;
+		statistics->allocatedPages += Magazines[i].allocatedPages;
+		statistics->freedPages += Magazines[i].freedPages;
+		UnlockMagazine(&Magazines[i]);
+		
+		RestoreInterrupts(interrupts);
+	}
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	statistics->allocatedPages += AllocatedPages;
+	statistics->freedPages += FreedPages;
+	
+	for (uint32_t i = 0; i < kPhyMemZoneCount; i++) {
+		statistics->zoneFreePages[i] = Zones[i].freePages;
+		statistics->totalPages += Zones[i].presentPages;
+		statistics->freePages += Zones[i].freePages;
+	}
+	
+	statistics->freePages += statistics->magazinePages + statistics->zeroedPoolPages;
+	
+	// The highest order with a free block, only its
+	// top summary level needs to be looked at
+	for (int32_t order = kPhyMemMaxOrder; order >= 0 && statistics->largestFreeBlock == 0; order--) {
+		BlockBitmap* bitmap = &Orders[order];
+		
+		for (uint32_t i = 0; i < bitmap->summaryTopCount; i++) {
+			if (bitmap->summaryTop[i] != 0) {
+				statistics->largestFreeBlock = 1U << order;
+				break;
+			}
+		}
+	}
+	
+	UnlockBitmaps(interrupts);
+}
+
+bool PhyMemAlloc(pointer_t* address)
+{
 	if (address == NULL) {
 		// TODO: panic()
 
 		return false;
 	}
+	
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	Magazine* magazine = &Magazines[CPUGetCurrentNumber()];
+	uint32_t page;
+	
+	LockMagazine(magazine);
+	
+	if (magazine->count > 0) {
+		magazine->hits++;
+	}
+	else {
+		magazine->misses++;
+		
+		// Refill in one batch, so the next allocations stay local
+		uint32_t bitmapsInterrupts = LockBitmaps();
+		
+		while (magazine->count < MagazineLowWatermark && AllocBlock(&page, 0, kDefaultZone))
+			magazine->pages[magazine->count++] = AddressFromPageNumber(page);
+		
+		UnlockBitmaps(bitmapsInterrupts);
+	}
+	
+	if (magazine->count > 0) {
+		*address = magazine->pages[--magazine->count];
+		magazine->allocatedPages++;
+		
+		UnlockMagazine(magazine);
+		RestoreInterrupts(interrupts);
+		
+		return true;
+	}
+	
+	UnlockMagazine(magazine);
+	RestoreInterrupts(interrupts);
+	
+	// Maybe the low watermark is 0, or other cpus hold
+	// the remaining pages in their magazines.
+	DrainAllMagazines();
+	
+	interrupts = LockBitmaps();
+	
+	bool success = AllocBlock(&page, 0, kDefaultZone);
+	
+	if (success) {
+		*address = AddressFromPageNumber(page);
+		AllocatedPages++;
+	}
+	
+	UnlockBitmaps(interrupts);
+	
+	return success;
+}
 
-	// Find a free page
-	for (planeIndex = 0; planeIndex < kFreeBitmapPlanes; planeIndex++) {
-		uint32_t currentPlane = FreeBitmap[planeIndex];
-		uint8_t bitInPlane;
+void PhyMemFree(page_t address)
+{
+	uint32_t pageNumber = PageNumberFromAddress(address);
+	
+	// Not a page we manage
+	if (pageNumber >= PageCount) {
+		LogError("PhyMem: Freeing invalid page %p", address);
+		
+		return;
+	}
+	
+	ClearFrames(pageNumber, 1);
+	
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	Magazine* magazine = &Magazines[CPUGetCurrentNumber()];
+	
+	LockMagazine(magazine);
+	
+	magazine->freedPages++;
+	
+	// Make room before writing, the watermarks may have been
+	// lowered since the last free. Afterwards the count is at
+	// most the low watermark, which is below the high one and
+	// so below the magazine size.
+	if (magazine->count >= MagazineHighWatermark)
+		DrainMagazine(magazine, MagazineLowWatermark);
+	
+	magazine->pages[magazine->count++] = AddressFromPageNumber(pageNumber);
+	
+	if (magazine->count >= MagazineHighWatermark)
+		DrainMagazine(magazine, MagazineLowWatermark);
+	
+	UnlockMagazine(magazine);
+	RestoreInterrupts(interrupts);
+}
 
-		// This plane has no free page avaiable, so proceed.
-		if (currentPlane == 0)
+//
+// Takes up to count free pages out of one plane
+//
+// @returns the number of pages taken
+//
+static uint32_t TakePagesFromPlane(uint32_t planeNumber, page_t* pages, uint32_t count)
+{
+	uint32_t value = Orders[0].planes[planeNumber];
+	uint32_t taken = 0;
+	
+	while (value != 0 && taken < count) {
+		uint32_t bit = FirstSetBit(value);
+		
+		pages[taken++] = AddressFromPageNumber((planeNumber << 5) | bit);
+		value &= ~(1U << bit);
+	}
+	
+	SetPagePlane(planeNumber, value);
+	UpdateOrders(planeNumber << 5, (planeNumber << 5) | 0x1F);
+	
+	return taken;
+}
+
+//
+// Marks the pages free in the block bitmaps, one plane
+// at a time. The bitmaps have to be locked.
+//
+// @returns the number of pages freed, pages outside of
+//          the bitmaps are skipped
+//
+static uint32_t FreePages(const page_t* pages, size_t count)
+{
+	uint32_t freed = 0;
+	uint32_t i = 0;
+	
+	while (i < count) {
+		uint32_t planeNumber = PageNumberFromAddress(pages[i]) >> 5;
+		uint32_t mask = 0;
+		
+		// Not a page we manage
+		if (planeNumber >= Orders[0].planeCount) {
+			LogError("PhyMem: Freeing invalid page %p", pages[i]);
+			i++;
 			continue;
+		}
+		
+		// Collect all following pages in the same plane
+		for (; i < count && PageNumberFromAddress(pages[i]) >> 5 == planeNumber; i++) {
+			ClearFrames(PageNumberFromAddress(pages[i]), 1);
+			mask |= 1U << (PageNumberFromAddress(pages[i]) & 0x1F);
+			freed++;
+		}
+		
+		SetPagePlane(planeNumber, Orders[0].planes[planeNumber] | mask);
+		UpdateOrders(planeNumber << 5, (planeNumber << 5) | 0x1F);
+	}
+	
+	return freed;
+}
 
-		for (bitInPlane = 0; bitInPlane < 32; bitInPlane++) {
-			if ((((currentPlane >> bitInPlane) & 0x1) == 1))
-				break;
+bool PhyMemAllocBatch(page_t* pages, size_t count)
+{
+	uint32_t allocated = 0;
+	bool drained = false;
+	uint32_t interrupts = LockBitmaps();
+	
+	while (allocated < count) {
+		uint32_t page;
+		
+		if (!FindFreeBlock(0, kDefaultZone, &page)) {
+			// The magazines may hold what we need
+			if (!drained) {
+				UnlockBitmaps(interrupts);
+				DrainAllMagazines();
+				drained = true;
+				interrupts = LockBitmaps();
+				continue;
+			}
+			
+			// All or nothing, the pages were never
+			// handed out so they are not counted
+			FreePages(pages, allocated);
+			UnlockBitmaps(interrupts);
+			
+			return false;
 		}
+		
+		allocated += TakePagesFromPlane(page >> 5, &pages[allocated], count - allocated);
+	}
+	
+	AllocatedPages += count;
+	
+	UnlockBitmaps(interrupts);
+	
+	return true;
+}
 
-		/*
-		 Because the currentPlane is not 0, there must be at least one bit set in it. Therfore now
-		 we have found this bit. =)
-		*/
+void PhyMemFreeBatch(const page_t* pages, size_t count)
+{
+	uint32_t interrupts = LockBitmaps();
+	
+	FreedPages += FreePages(pages, count);
+	
+	UnlockBitmaps(interrupts);
+}
 
-		// Calculate the address
-		*address = AddressFromPlaneAndBit(planeIndex, bitInPlane);
+bool PhyMemAllocFromZone(page_t* address, PhyMemZone zone)
+{
+	return PhyMemAllocContiguousFromZone(address, 0, zone);
+}
 
-		// Mark it as used
-		_PhyMemMarkUsed(*address);
+bool PhyMemAllocContiguous(page_t* address, uint8_t order)
+{
+	return PhyMemAllocContiguousFromZone(address, order, kDefaultZone);
+}
 
-		return true;
+bool PhyMemAllocContiguousFromZone(page_t* address, uint8_t order, PhyMemZone zone)
+{
+	uint32_t page;
+	
+	if (address == NULL) {
+		// TODO: panic()
+
+		return false;
+	}
+	
+	assert(order <= kPhyMemMaxOrder);
+	assert(zone < kPhyMemZoneCount);
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	if (!AllocBlock(&page, order, zone)) {
+		UnlockBitmaps(interrupts);
+		
+		// The pages held by the magazines may
+		// prevent blocks from merging
+		DrainAllMagazines();
+		
+		interrupts = LockBitmaps();
+		
+		if (!AllocBlock(&page, order, zone)) {
+			UnlockBitmaps(interrupts);
+			
+			return false;
+		}
 	}
+	
+	// Calculate the address
+	*address = AddressFromPageNumber(page);
+	AllocatedPages += 1U << order;
+	
+	UnlockBitmaps(interrupts);
+	
+	return true;
+}
 
-	return false;
+void PhyMemFreeContiguous(page_t address, uint8_t order)
+{
+	assert(order <= kPhyMemMaxOrder);
+	// Blocks are always naturally aligned
+	assert((PageNumberFromAddress(address) & ((1U << order) - 1)) == 0);
+	
+	ClearFrames(PageNumberFromAddress(address), 1U << order);
+	
+	uint32_t interrupts = LockBitmaps();
+	
+	FreedPages += 1U << order;
+	
+	// Marking it free merges it with its buddies
+	SetPages(PageNumberFromAddress(address), 1U << order, true);
+	
+	UnlockBitmaps(interrupts);
+}
+
+void PhyMemReserveFrameDatabase(uint32_t frameCount)
+{
+	uint32_t pageCount = (frameCount * sizeof(PhyMemFrame) + kPhyMemPageSize - 1) >> kPageShift;
+	uint8_t order = 0;
+	page_t firstPage;
+	
+	assert(FrameDatabasePageCount == 0);
+	
+	while ((1U << order) < pageCount)
+		order++;
+	
+	assert(order <= kPhyMemMaxOrder);
+	
+	if (!PhyMemAllocContiguous(&firstPage, order))
+		panic("Could not reserve frame database for %d frames", frameCount);
+	
+	// Give back the tail of the block we do not need
+	uint32_t interrupts = LockBitmaps();
+	
+	SetPages(PageNumberFromAddress(firstPage) + pageCount, (1U << order) - pageCount, true);
+	FreedPages += (1U << order) - pageCount;
+	
+	UnlockBitmaps(interrupts);
+	
+	FrameCount = frameCount;
+	FrameDatabaseFirstPage = firstPage;
+	FrameDatabasePageCount = pageCount;
+	
+	LogVerbose("Reserved frame database for %d frames at %p", frameCount, firstPage);
+}
+
+void PhyMemGetFrameDatabasePages(page_t* firstPage, size_t* numberOfPages)
+{
+	*firstPage = FrameDatabaseFirstPage;
+	*numberOfPages = FrameDatabasePageCount;
+}
+
+void PhyMemAttachFrameDatabase(pointer_t address)
+{
+	PhyMemFrame* frames = address;
+	
+	assert(FrameDatabasePageCount > 0);
+	
+	for (uint32_t i = 0; i < FrameCount; i++) {
+		frames[i].mapCount = 0;
+		frames[i].flags = 0;
+	}
+	
+	FrameDatabase = frames;
+}
+
+PhyMemFrame* PhyMemGetFrame(page_t page)
+{
+	uint32_t pageNumber = PageNumberFromAddress(page);
+	
+	if (FrameDatabase == NULL || pageNumber >= FrameCount)
+		return NULL;
+	
+	return &FrameDatabase[pageNumber];
+}
+
+uint16_t PhyMemFrameMapped(page_t page)
+{
+	PhyMemFrame* frame = PhyMemGetFrame(page);
+	
+	if (frame == NULL)
+		return 0;
+	
+	return __sync_add_and_fetch(&frame->mapCount, 1);
+}
+
+uint16_t PhyMemFrameUnmapped(page_t page)
+{
+	PhyMemFrame* frame = PhyMemGetFrame(page);
+	
+	if (frame == NULL)
+		return 0;
+	
+	assert(frame->mapCount > 0);
+	
+	return __sync_sub_and_fetch(&frame->mapCount, 1);
 }
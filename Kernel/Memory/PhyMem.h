@@ -39,10 +39,52 @@ static const uint32_t kPhyMemPageSize = 4 * 1024 /* 4 KiB */;
 static const page_t kPhyInvalidPage = (void*)0xFFFFFFFF;
 static const uint32_t kPhyPageMask = 0xFFFFF000;
 
+//
+// The highest order PhyMemAllocContiguous can hand out.
+// A block of order n consists of 2^n pages, so the largest
+// block is 4 MiB which matches a large page on x86.
+//
+static const uint8_t kPhyMemMaxOrder = 10;
+
+//
+// Zones
+// =====
+//
+// Physical memory is split into zones by address. Allocations
+// start in the requested zone and only fall back to zones below
+// it, so low memory stays available for devices which need it.
+//
+typedef enum {
+	// Below 16 MiB, reachable by legacy DMA
+	kPhyMemZoneDMA,
+	// 16 MiB up to 896 MiB
+	kPhyMemZoneNormal,
+	// Above 896 MiB
+	kPhyMemZoneHigh,
+	
+	kPhyMemZoneCount
+} PhyMemZone;
+
+//
+// Gets the number of bytes needed for the bitmaps covering
+// pageCount pages. This is always a multiple of the page size.
+//
+size_t PhyMemGetBitmapSize(uint32_t pageCount);
+
 //
 // Initializes the phy mem subsystem
 //
-void PhyMemInitialize();
+// @param pageCount Number of pages up to the top of memory
+// @param bitmap Mapped storage of PhyMemGetBitmapSize(pageCount) bytes
+// @param bitmapPage Physical address of the storage
+//
+void PhyMemInitialize(uint32_t pageCount, pointer_t bitmap, page_t bitmapPage);
+
+//
+// Gets the pages holding the bitmaps, so the vm subsystem
+// can map them.
+//
+void PhyMemGetBitmapPages(page_t* firstPage, size_t* numberOfPages);
 
 //
 // Initializetion routines. Be careful when using those
@@ -53,6 +95,12 @@ void _PhyMemMarkUsed(page_t page);
 void _PhyMemMarkUsedRange(page_t address, size_t size);
 void _PhyMemMarkFreeRange(page_t address, size_t size);
 
+//
+// Registers a range of ram reported by the bootloader. The range
+// is marked free and accounted to the zones it covers.
+//
+void _PhyMemAddAvailableRange(page_t address, size_t size);
+
 //
 // Print phy mem layout
 //
@@ -72,6 +120,255 @@ void LogPhyMem();
 // 					
 bool PhyMemAlloc(page_t* address);
 
+//
+// Alloc a page from a given zone, or one of the zones below it
+// if the zone has no free page left.
+//
+// @see PhyMemAlloc
+//
+bool PhyMemAllocFromZone(page_t* address, PhyMemZone zone);
+
+// Alloc 2^order physically contiguous pages and returns the address
+// of the first one. The block is aligned to its size.
+// 
+// @param address Pointer to an page_t value that will contain the
+//                address of the first page of the block.
+// @param order The size of the block as power of two pages.
+//              Must not be larger than kPhyMemMaxOrder.
+// @return Returns true if the allocation succeeded. false otherwise.
+//
+bool PhyMemAllocContiguous(page_t* address, uint8_t order);
+
+//
+// Same as PhyMemAllocContiguous but allocates from a given zone,
+// or one of the zones below it.
+//
+bool PhyMemAllocContiguousFromZone(page_t* address, uint8_t order, PhyMemZone zone);
+
+//
+// Frees a block allocated by PhyMemAllocContiguous. The order
+// has to be the same as the one used for the allocation.
+//
+void PhyMemFreeContiguous(page_t address, uint8_t order);
+
+//
+// Alloc a page which is filled with zeros. The page is taken
+// from a pool refilled while the cpu is idle, and only zeroed
+// on the spot when the pool is empty.
+//
+// Must not be used before the vm subsystem is initialized.
+//
+// @see PhyMemAlloc
+//
+bool PhyMemAllocZeroed(page_t* address);
+
+//
+// Gives the pages of the zeroed pools of all cpus back. PhyMem
+// calls this itself when it runs out of pages.
+//
+void PhyMemDrainZeroedPools();
+
+//
+// Gets the number of pages held by the zeroed pools of all cpus
+//
+uint32_t PhyMemGetZeroedPoolPages();
+
+//
+// Frees a page allocated by PhyMemAlloc or PhyMemAllocZeroed.
+//
+void PhyMemFree(page_t address);
+
+//
+// Allocates count pages at once. The pages are taken a whole
+// plane of the bitmap at a time, so this is much cheaper than
+// calling PhyMemAlloc count times.
+//
+// Either all or none of the pages get allocated.
+//
+// @param pages Array with space for count pages
+// @return Returns true if the allocation succeeded. false otherwise.
+//
+bool PhyMemAllocBatch(page_t* pages, size_t count);
+
+//
+// Frees count pages at once. Pages next to each other in the
+// array which share a plane of the bitmap are freed together.
+//
+void PhyMemFreeBatch(const page_t* pages, size_t count);
+
+//
+// Magazines
+// =========
+//
+// PhyMemAlloc and PhyMemFree are served from a per cpu magazine
+// of pages. An empty magazine gets refilled up to the low watermark,
+// a magazine reaching the high watermark gets drained down to the
+// low watermark.
+//
+static const uint32_t kPhyMemMagazineSize = 64;
+
+typedef struct {
+	// Pages currently held by the magazine
+	uint32_t count;
+	// Allocations served by the magazine
+	uint32_t hits;
+	// Allocations which needed a refill
+	uint32_t misses;
+} PhyMemMagazineStatistics;
+
+//
+// Sets the watermarks for all magazines.
+//
+// @param low Pages kept after a refill or drain
+// @param high Pages at which a magazine gets drained.
+//             Must be larger than low and not larger than
+//             kPhyMemMagazineSize.
+//
+void PhyMemSetMagazineWatermarks(uint32_t low, uint32_t high);
+
+//
+// Gets the statistics of the magazine of a cpu
+//
+void PhyMemGetMagazineStatistics(uint32_t cpu, PhyMemMagazineStatistics* statistics);
+
+//
+// Gets the number of free pages in a zone. Pages held by
+// magazines are not counted.
+//
+uint32_t PhyMemGetZoneFreePages(PhyMemZone zone);
+
+//
+// Gets the number of pages in a zone reported as
+// available by the bootloader.
+//
+uint32_t PhyMemGetZonePresentPages(PhyMemZone zone);
+
+//
+// Free pages kept for allocations which can not wait. Caches
+// of free pages, like the zeroed pools, stop growing once
+// fewer pages are left.
+//
+static const uint32_t kPhyMemReservePages = 256 /* 1 MiB */;
+
+//
+// @return true when fewer than kPhyMemReservePages pages are
+//         free outside of the magazines
+//
+bool PhyMemIsLow();
+
+//
+// Statistics
+// ==========
+//
+// The counters are kept up to date by the allocation functions,
+// so querying them is cheap enough to do at any time.
+//
+typedef struct {
+	// Pages reported as available by the bootloader
+	uint32_t totalPages;
+	// Free pages, including the ones held by magazines
+	// and zeroed pools
+	uint32_t freePages;
+	// Free pages per zone, excluding magazines and zeroed pools
+	uint32_t zoneFreePages[kPhyMemZoneCount];
+	// Pages held by the magazines of all cpus
+	uint32_t magazinePages;
+	// Pages held by the zeroed pools of all cpus. They were
+	// counted as allocated when they were put there.
+	uint32_t zeroedPoolPages;
+	// Pages in the largest free block PhyMemAllocContiguous can
+	// hand out right now, without draining magazines
+	uint32_t largestFreeBlock;
+	// Pages handed out since initialization. The allocation
+	// rate is the difference between two queries.
+	uint64_t allocatedPages;
+	// Pages given back since initialization
+	uint64_t freedPages;
+} PhyMemStatistics;
+
+void PhyMemGetStatistics(PhyMemStatistics* statistics);
+
+//
+// Page frame database
+// ===================
+//
+// Every physical page below the top of memory has a frame
+// descriptor holding the metadata the vm subsystem needs to
+// share, copy-on-write and reclaim pages.
+//
+// The database lives in pages reserved during boot. It only
+// becomes usable after the vm subsystem mapped it and called
+// PhyMemAttachFrameDatabase, until then PhyMemGetFrame
+// returns NULL.
+//
+typedef struct {
+	// Number of mappings of this page, update atomically
+	uint16_t mapCount;
+	// PhyMemFrameFlags, update atomically
+	uint16_t flags;
+} PhyMemFrame;
+
+typedef enum {
+	// Page was written to since it was last cleaned
+	kPhyMemFrameDirty = (1 << 0),
+	// Page was accessed recently
+	kPhyMemFrameReferenced = (1 << 1),
+	// Page is shared and has to be copied before writing to it
+	kPhyMemFrameCopyOnWrite = (1 << 2),
+	// Page must not be reclaimed
+	kPhyMemFrameLocked = (1 << 3)
+} PhyMemFrameFlags;
+
+//
+// Reserves the pages for a database of frameCount frames. Must be
+// called after all used ranges were marked.
+//
+void PhyMemReserveFrameDatabase(uint32_t frameCount);
+
+//
+// Gets the pages reserved for the frame database, so the vm
+// subsystem can map them.
+//
+void PhyMemGetFrameDatabasePages(page_t* firstPage, size_t* numberOfPages);
+
+//
+// Clears the frame database mapped at address and starts using it.
+// Mappings made before have to be accounted by the caller.
+//
+void PhyMemAttachFrameDatabase(pointer_t address);
+
+//
+// Gets the frame descriptor of a page
+//
+// @return the frame or NULL if the page is not covered or the
+//         database is not attached yet.
+//
+PhyMemFrame* PhyMemGetFrame(page_t page);
+
+//
+// Accounts a new mapping of a page.
+//
+// @return the new map count, 0 if the page has no frame.
+//
+uint16_t PhyMemFrameMapped(page_t page);
+
+//
+// Accounts the removal of a mapping of a page.
+//
+// @return the remaining map count, 0 if the page has no frame.
+//
+uint16_t PhyMemFrameUnmapped(page_t page);
+
+static inline void PhyMemFrameSetFlags(PhyMemFrame* frame, uint16_t flags)
+{
+	__sync_fetch_and_or(&frame->flags, flags);
+}
+
+static inline void PhyMemFrameClearFlags(PhyMemFrame* frame, uint16_t flags)
+{
+	__sync_fetch_and_and(&frame->flags, (uint16_t)~flags);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,192 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "PhyMem.h"
+
+#include "VM/VM.h"
+#include "VM/Backend.h"
+#include "Interrupts/Idle.h"
+#include "Utils/CPU.h"
+#include "Utils/Spinlock.h"
+#include "Utils/Memutils.h"
+#include "Error/Assert.h"
+
+#include <CoreSystem/MachineInstructions.h>
+
+//
+// Zeroed pages
+// ============
+//
+// Every cpu keeps a small pool of zeroed pages which is
+// refilled by an idle handler. The pools are only touched
+// with interrupts disabled and their lock held, which other
+// cpus only take to drain a pool when PhyMem runs out of
+// pages. No pool lock is held while calling into PhyMem.
+//
+static const uint32_t kZeroedPoolSize = 32;
+
+typedef struct {
+	page_t pages[kZeroedPoolSize];
+	uint32_t count;
+	Spinlock lock;
+} ZeroedPool;
+
+static ZeroedPool ZeroedPools[kCPUMaxCount];
+
+static inline void LockPool(ZeroedPool* pool)
+{
+	SpinlockLock(&pool->lock);
+}
+
+static inline void UnlockPool(ZeroedPool* pool)
+{
+	SpinlockUnlock(&pool->lock);
+}
+
+//
+// Zeros a page through the scratch page of the current cpu
+//
+static void ZeroPage(page_t page)
+{
+	Ptr<VM::Backend::Context> kernelContext = VM::Backend::GetKernelContext();
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	pointer_t scratch = (pointer_t)(VM::kScratchPagesAddress + CPUGetCurrentNumber() * kPhyMemPageSize);
+	
+	assert(kernelContext->map(page, scratch, VM::Permission::Read | VM::Permission::Write, 0));
+	memset(scratch, 0, kPhyMemPageSize);
+	assert(kernelContext->unmap(scratch));
+	
+	RestoreInterrupts(interrupts);
+}
+
+bool PhyMemAllocZeroed(page_t* address)
+{
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	ZeroedPool* pool = &ZeroedPools[CPUGetCurrentNumber()];
+	bool found = false;
+	
+	LockPool(pool);
+	
+	if (pool->count > 0) {
+		*address = pool->pages[--pool->count];
+		found = true;
+	}
+	
+	UnlockPool(pool);
+	RestoreInterrupts(interrupts);
+	
+	if (found)
+		return true;
+	
+	if (!PhyMemAlloc(address))
+		return false;
+	
+	ZeroPage(*address);
+	
+	return true;
+}
+
+void PhyMemDrainZeroedPools()
+{
+	for (uint32_t i = 0; i < kCPUMaxCount; i++) {
+		ZeroedPool* pool = &ZeroedPools[i];
+		page_t pages[kZeroedPoolSize];
+		uint32_t count;
+		
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		LockPool(pool);
+		
+		count = pool->count;
+		for (uint32_t j = 0; j < count; j++)
+			pages[j] = pool->pages[j];
+		pool->count = 0;
+		
+		UnlockPool(pool);
+		RestoreInterrupts(interrupts);
+		
+		if (count > 0)
+			PhyMemFreeBatch(pages, count);
+	}
+}
+
+uint32_t PhyMemGetZeroedPoolPages()
+{
+	uint32_t count = 0;
+	
+	for (uint32_t i = 0; i < kCPUMaxCount; i++) {
+		ZeroedPool* pool = &ZeroedPools[i];
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		
+		LockPool(pool);
+		count += pool->count;
+		UnlockPool(pool);
+		
+		RestoreInterrupts(interrupts);
+	}
+	
+	return count;
+}
+
+//
+// Zeros one page per call until the pool is full
+//
+static bool FillZeroedPool()
+{
+	ZeroedPool* pool = &ZeroedPools[CPUGetCurrentNumber()];
+	page_t page;
+	
+	if (pool->count >= kZeroedPoolSize)
+		return false;
+	
+	// Leave the last pages to allocations which need them
+	if (PhyMemIsLow())
+		return false;
+	
+	if (!PhyMemAlloc(&page))
+		return false;
+	
+	ZeroPage(page);
+	
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	bool added = false;
+	bool pending = false;
+	
+	LockPool(pool);
+	
+	if (pool->count < kZeroedPoolSize) {
+		pool->pages[pool->count++] = page;
+		added = true;
+		pending = pool->count < kZeroedPoolSize;
+	}
+	
+	UnlockPool(pool);
+	RestoreInterrupts(interrupts);
+	
+	if (!added)
+		PhyMemFree(page);
+	
+	return pending;
+}
+
+IdleRegisterHandler(FillZeroedPool);
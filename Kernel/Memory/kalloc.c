@@ -26,6 +26,15 @@
 
 #include "Error/Assert.h"
 #include "Logging/Logging.h"
+#include "Utils/CPU.h"
+#include "Utils/Bits.h"
+#include "Utils/Spinlock.h"
+#include "Utils/Memutils.h"
+#include "Memory/PhyMem.h"
+#include "Memory/PageOwners.h"
+#include "Interrupts/Idle.h"
+
+#include <CoreSystem/MachineInstructions.h>
 
 // kalloc is loosly based on http://g.oswego.edu/dl/html/malloc.html
 
@@ -35,13 +44,27 @@
 typedef size_t ChunkFlags;
 static const ChunkFlags kChunkFree = (1 << 0);
 static const ChunkFlags kChunkUsed = (1 << 1);
+// The chunk in front of this one is free and ends with its size
+static const ChunkFlags kChunkPrevFree = (1 << 2);
 
 static const size_t ChunkFlagsMask = 0x7;
 
+//
+// Used chunks keep the cpu which allocated them in the top 8 bits
+// of the size, so chunks (and therefore heaps) are limited to 16 MiB
+//
+static const size_t kChunkOwnerShift = 24;
+static const size_t kChunkOwnerMask = 0x7F000000;
+// Set on chunks picked by the profiler
+static const size_t kChunkSampled = 0x80000000;
+static const size_t kChunkTagMask = kChunkOwnerMask | kChunkSampled;
+static const size_t kMaxHeapSize = 1 << kChunkOwnerShift;
+
 // This chunk structure will be placed at the beginning of
-// every free chunk.
+// every free chunk. Free chunks also repeat their size in their
+// last word, so the chunk behind them can find them.
 //
-// Therefore the minimum freeable size is sizeof(FreeChunk) = 16bytes (on 32bit)
+// Therefore the minimum freeable size is sizeof(FreeChunk) + 4 = 16bytes (on 32bit)
 // which means the minimum allocatable size is also 16bytes (12 usable)
 typedef struct FreeChunk FreeChunk;
 struct FreeChunk {
@@ -57,30 +80,118 @@ typedef struct {
 	size_t size; // Lower 4 bits are flags
 } UsedChunk;
 
+static const size_t kMinChunkSize = (sizeof(FreeChunk) + sizeof(size_t) + 0x7) & ~(size_t)0x7;
+
+//
+// Chunks start 4 bytes before a multiple of 8, so the memory
+// behind their header is 8 byte aligned
+//
+static inline offset_t ChunkAlignUp(offset_t address)
+{
+	return ((address + sizeof(UsedChunk) + 0x7) & ~(offset_t)0x7) - sizeof(UsedChunk);
+}
+
+static inline offset_t ChunkAlignDown(offset_t address)
+{
+	return ((address + sizeof(UsedChunk)) & ~(offset_t)0x7) - sizeof(UsedChunk);
+}
+
+//
+// Bins
+// ====
+//
+// Free chunks are kept in bins by their size. Chunks smaller than
+// kSmallBinLimit have an exact bin per multiple of 8 bytes, so any
+// of them fits a request of that size.
+//
+// Larger chunks go into large bins which cover a range of sizes,
+// four per power of two. Large bins are kept sorted by size, so
+// the first chunk fitting a request is also the best fitting one.
+//
+// Each heap has a bitmap of its non empty bins, finding the next
+// bin to take a chunk from is a single bit scan.
+//
+static const size_t kSmallBinLimit = 256;
+static const uint32_t kSmallBinCount = kSmallBinLimit >> 3;
+// 4 bins for every power of two from 2^8 to 2^31
+static const uint32_t kLargeBinCount = 4 * 24;
+static const uint32_t kLargeBinMapWords = (kLargeBinCount + 31) / 32;
+
 //
 // This structure represents one zone of heap
 //
 typedef struct Heap Heap;
 struct Heap {
+	// Owner of the heap pages, first so the
+	// owner found for a pointer is the heap
+	PageOwner owner;
+	
 	// Base chunk, never allocated
 	// First one is inline, as we allocate
 	// this heap structure on our new heap.
-	FreeChunk start;
-	// Additional vars go here
+	UsedChunk start;
+	
+	// Heads of the bins
+	FreeChunk* smallBins[kSmallBinCount];
+	FreeChunk* largeBins[kLargeBinCount];
+	// Bitmaps of the non empty bins
+	uint32_t smallBinMap;
+	uint32_t largeBinMap[kLargeBinMapWords];
 	
 	// Last chunk in heap, never allocated
-	FreeChunk* end;
+	UsedChunk* end;
+	
+	// Pages taken from the page provider,
+	// 0 for heaps added by hand
+	size_t pageCount;
 };
 
 // Helper Functions
 static inline size_t ChunkSize(void* c) {
 	UsedChunk* chunk = c;
-	return chunk->size & ~ChunkFlagsMask;
+	return chunk->size & ~(ChunkFlagsMask | kChunkTagMask);
+}
+
+static inline uint32_t ChunkOwner(void* c) {
+	UsedChunk* chunk = c;
+	return (uint32_t)((chunk->size & kChunkOwnerMask) >> kChunkOwnerShift);
+}
+
+//
+// Marks a chunk free and writes its footer, the chunk behind
+// it learns that it can merge with it
+//
+static inline void ChunkMarkFree(FreeChunk* chunk)
+{
+	size_t size = ChunkSize(chunk);
+	UsedChunk* next = (UsedChunk*)OFFSET(chunk, size);
+	
+	chunk->size = size | kChunkFree;
+	*(size_t*)OFFSET(chunk, size - sizeof(size_t)) = size;
+	next->size |= kChunkPrevFree;
+}
+
+static inline uint32_t LargeBinIndex(size_t size)
+{
+	uint32_t log = 31 - (uint32_t)__builtin_clz((uint32_t)size);
+	
+	// The two bits below the leading one pick the quarter
+	return (log - 8) * 4 + (((uint32_t)size >> (log - 2)) & 0x3);
 }
 
 static Heap* _KallocInitializeHeap(void* ptr, size_t size);
 void* kalloc_heap(Heap* heap, size_t size);
 void free_heap(Heap* heap, void* ptr);
+static void free_heaps(void* ptr);
+static void AddHeap(void* ptr, size_t size, size_t pageCount);
+static void HeapFree(PageOwner* owner, void* ptr);
+static void* AllocateFromHeaps(size_t size, size_t align);
+static bool GrowHeaps(size_t chunkSize);
+static void* kalloc_heap_aligned(Heap* heap, size_t size, size_t align);
+static void PagesFree(PageOwner* owner, void* ptr);
+static bool CacheChunk(UsedChunk* chunk, size_t chunkSize);
+static bool CacheLocalChunk(UsedChunk* chunk, size_t chunkSize);
+static bool ResizeChunk(Heap* heap, UsedChunk* chunk, size_t size);
 
 // Storage for all the heaps we have
 Heap** heaps;
@@ -89,12 +200,215 @@ uint32_t heapsCount;
 // How many slot to store heaps do we have
 uint32_t heapsSlots;
 
+//
+// Heap growth
+// ===========
+//
+// When no heap can satisfy a request, a new heap is made from
+// pages of the provider. Heaps are at least kHeapGrowSize large,
+// so small allocations do not map pages one by one.
+//
+static KallocPageProvider PageProvider;
+static KallocPageReleaser PageReleaser;
+static const size_t kHeapGrowSize = 64 * 1024 /* 64 KiB */;
+
+//
+// Chunks of at least this size are allocated with kalloc_pages.
+// Page allocations are never handed out for smaller requests, so
+// kfree_sized knows from the size alone that memory belongs to
+// a heap.
+//
+static const size_t kPageAllocationSize = 32 * 1024 /* 32 KiB */;
+
+//
+// The heaps are shared by all cpus, so they are only
+// touched with this lock held and interrupts disabled
+//
+static Spinlock HeapsLock;
+
+static inline uint32_t LockHeaps()
+{
+	return SpinlockLockSave(&HeapsLock);
+}
+
+static inline void UnlockHeaps(uint32_t interrupts)
+{
+	SpinlockUnlockRestore(&HeapsLock, interrupts);
+}
+
+//
+// Per cpu caches
+// ==============
+//
+// Every cpu caches a few freed chunks of every small size, which
+// are handed out again without touching the heaps or their lock.
+// Cached chunks stay marked used in their heap.
+//
+// A chunk freed on another cpu than the one which allocated it is
+// pushed onto the remote free queue of its owner. The queue is a
+// lock free stack, the owner takes all of it at once when its
+// cache runs empty.
+//
+static const uint8_t kCPUCacheDepth = 16;
+
+typedef struct {
+	// Linked through FreeChunk.next
+	FreeChunk* chunks[kSmallBinCount];
+	uint8_t counts[kSmallBinCount];
+	// Pushed by other cpus, linked through FreeChunk.next
+	FreeChunk* volatile remoteFrees;
+} CPUCache;
+
+static CPUCache CPUCaches[kCPUMaxCount];
+
+static void DrainRemoteFrees(CPUCache* cache);
+
+//
+// Gets the size of the chunk needed for a request
+//
+static inline size_t ChunkSizeForRequest(size_t size)
+{
+	// Adjust size for our overhead
+	size += sizeof(UsedChunk);
+	
+	// Align our size
+	if (size & 0x7)
+		size = (size & (size_t)~0x7) + 8;
+	
+	if (size < kMinChunkSize)
+		size = kMinChunkSize;
+	
+	return size;
+}
+
+//
+// Puts a free chunk into its bin
+//
+static void BinInsert(Heap* heap, FreeChunk* chunk)
+{
+	size_t size = ChunkSize(chunk);
+	
+	if (size < kSmallBinLimit) {
+		uint32_t index = (uint32_t)(size >> 3);
+		
+		chunk->prev = NULL;
+		chunk->next = heap->smallBins[index];
+		if (chunk->next)
+			chunk->next->prev = chunk;
+		
+		heap->smallBins[index] = chunk;
+		heap->smallBinMap |= 1U << index;
+	}
+	else {
+		uint32_t index = LargeBinIndex(size);
+		FreeChunk* prev = NULL;
+		FreeChunk* next = heap->largeBins[index];
+		
+		// Keep the bin sorted by size
+		while (next && ChunkSize(next) < size) {
+			prev = next;
+			next = next->next;
+		}
+		
+		chunk->prev = prev;
+		chunk->next = next;
+		if (next)
+			next->prev = chunk;
+		if (prev)
+			prev->next = chunk;
+		else
+			heap->largeBins[index] = chunk;
+		
+		heap->largeBinMap[index / 32] |= 1U << (index % 32);
+	}
+}
+
+//
+// Takes a free chunk out of its bin
+//
+static void BinRemove(Heap* heap, FreeChunk* chunk)
+{
+	size_t size = ChunkSize(chunk);
+	
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	
+	if (chunk->prev) {
+		chunk->prev->next = chunk->next;
+	}
+	else if (size < kSmallBinLimit) {
+		uint32_t index = (uint32_t)(size >> 3);
+		
+		heap->smallBins[index] = chunk->next;
+		if (chunk->next == NULL)
+			heap->smallBinMap &= ~(1U << index);
+	}
+	else {
+		uint32_t index = LargeBinIndex(size);
+		
+		heap->largeBins[index] = chunk->next;
+		if (chunk->next == NULL)
+			heap->largeBinMap[index / 32] &= ~(1U << (index % 32));
+	}
+}
+
+//
+// Finds the smallest free chunk of at least size bytes
+//
+static FreeChunk* BinFind(Heap* heap, size_t size)
+{
+	uint32_t index = 0;
+	
+	if (size < kSmallBinLimit) {
+		uint32_t map = heap->smallBinMap & (kUInt32Max << (size >> 3));
+		
+		if (map)
+			return heap->smallBins[FirstSetBit(map)];
+	}
+	else {
+		// Look for the best fit in its own bin first
+		index = LargeBinIndex(size);
+		
+		for (FreeChunk* chunk = heap->largeBins[index]; chunk; chunk = chunk->next) {
+			if (ChunkSize(chunk) >= size)
+				return chunk;
+		}
+		
+		index++;
+	}
+	
+	// Any chunk of a larger bin fits, the first is the smallest
+	for (uint32_t word = index / 32; word < kLargeBinMapWords; word++) {
+		uint32_t map = heap->largeBinMap[word];
+		
+		if (word == index / 32)
+			map &= kUInt32Max << (index % 32);
+		
+		if (map)
+			return heap->largeBins[word * 32 + FirstSetBit(map)];
+	}
+	
+	return NULL;
+}
+
 void KallocInitialize(void* ptr, size_t size)
 {
 	Heap* heap = _KallocInitializeHeap(ptr, size);
 	
+	for (uint32_t i = 0; i < kCPUMaxCount; i++) {
+		for (uint32_t j = 0; j < kSmallBinCount; j++) {
+			CPUCaches[i].chunks[j] = NULL;
+			CPUCaches[i].counts[j] = 0;
+		}
+		CPUCaches[i].remoteFrees = NULL;
+	}
+	
+	PageProvider = NULL;
+	PageReleaser = NULL;
+	
 	// Allocate some default space to store the heaps
-	// In most case we wont have more than 5
+	// In most case we wont have more than 5, more slots
+	// are allocated when needed
 	heapsCount = 0;
 	heapsSlots = 5;
 	heaps = kalloc_heap(heap, sizeof(Heap*) * heapsSlots);
@@ -105,187 +419,1043 @@ void KallocInitialize(void* ptr, size_t size)
 
 void KallocAddHeap(void* ptr, size_t size)
 {
-	// TODO: Resizing the heaps array is unsupported
-	assert(heapsCount < heapsSlots);
+	AddHeap(ptr, size, 0);
+}
+
+static void AddHeap(void* ptr, size_t size, size_t pageCount)
+{
+	Heap* heap = _KallocInitializeHeap(ptr, size);
+	heap->pageCount = pageCount;
 	
-	heapsCount++;
+	uint32_t interrupts = LockHeaps();
+	
+	if (heapsCount == heapsSlots) {
+		// Double the slots, preferably in the new heap
+		Heap** oldHeaps = heaps;
+		Heap** newHeaps = kalloc_heap(heap, sizeof(Heap*) * heapsSlots * 2);
+		
+		for (uint32_t i = 0; i < heapsCount && newHeaps == NULL; i++)
+			newHeaps = kalloc_heap(heaps[i], sizeof(Heap*) * heapsSlots * 2);
+		
+		assert(newHeaps != NULL);
+		
+		for (uint32_t i = 0; i < heapsCount; i++)
+			newHeaps[i] = oldHeaps[i];
+		
+		heaps = newHeaps;
+		heapsSlots *= 2;
+		
+		free_heaps(oldHeaps);
+	}
 	
 	// Now to keep the startup heap always at the end
 	// we do some magic here
 	heaps[heapsCount] = heaps[heapsCount-1];
-	heaps[heapsCount-1] = _KallocInitializeHeap(ptr, size);
+	heaps[heapsCount-1] = heap;
+	
+	heapsCount++;
+	
+	UnlockHeaps(interrupts);
 }
 
-static Heap* _KallocInitializeHeap(void* ptr, size_t size)
+void KallocSetPageProvider(KallocPageProvider provider, KallocPageReleaser releaser)
 {
-	FreeChunk* chunk;
+	PageProvider = provider;
+	PageReleaser = releaser;
+}
+
+//
+// Adds a heap large enough for a chunk of chunkSize from
+// the page provider
+//
+static bool GrowHeaps(size_t chunkSize)
+{
+	// Room for the heap structure and the end chunk
+	size_t size = chunkSize + sizeof(Heap) + kMinChunkSize + 0x8;
 	
-	// Use the heap as storage for the heap structure
-	Heap* heap = ptr;
+	if (size < kHeapGrowSize)
+		size = kHeapGrowSize;
 	
-	// The start chunk is sized to contain the heap
-	// structure
-	heap->start.size = sizeof(Heap) | kChunkFree;
+	size = (size + kPhyMemPageSize - 1) & ~(kPhyMemPageSize - 1);
 	
-	// The end chunk is just a dummy chunk
-	heap->end = OFFSET(ptr, size - sizeof(FreeChunk));
-	heap->end->size = sizeof(FreeChunk) | kChunkFree;
+	if (PageProvider == NULL || size > kMaxHeapSize)
+		return false;
 	
-	// Now configure our real free chunk
-	chunk = OFFSET(ptr, sizeof(Heap));
-	chunk->size = size - heap->start.size - heap->end->size | kChunkFree;
+	void* ptr = PageProvider(size / kPhyMemPageSize);
 	
-	// Finally we establish our linked chunk list
-	heap->start.prev = heap->end->next = NULL;
-	heap->start.next = chunk;
-	chunk->next = heap->end;
-	heap->end->prev = chunk;
-	chunk->prev = &heap->start;
-		
-	return heap;
+	if (ptr == NULL)
+		return false;
+	
+	AddHeap(ptr, size, size / kPhyMemPageSize);
+	
+	return true;
 }
 
-void* kalloc(size_t size)
+//
+// Trimming
+// ========
+//
+// Heaps grown from the page provider give their pages back once
+// they are completely free. The idle handler keeps a few of them
+// around, so memory use going up and down does not map and unmap
+// pages all the time. KallocTrim gives back all of them.
+//
+// Idle handlers run with interrupts off, so the idle handler
+// takes out one heap at a time and gives back no more than
+// kTrimPagesPerCall of its pages per call.
+//
+// Chunks held by the per cpu caches keep their heap in use.
+//
+static const uint32_t kKeptIdleHeaps = 1;
+static const uint32_t kTrimBatchSize = 8;
+static const size_t kTrimPagesPerCall = 16;
+
+// Set when a grown heap became idle
+static volatile bool TrimPending;
+
+// Pages of a taken out heap every cpu still has to give back
+typedef struct {
+	void* address;
+	size_t pageCount;
+} TrimmedPages;
+
+static TrimmedPages TrimmedPagesLeft[kCPUMaxCount];
+
+static inline FreeChunk* HeapFirstChunk(Heap* heap)
 {
-	void* ptr = NULL;
-	
-	for (uint32_t i = 0; i < heapsCount && ptr == NULL; i++) {
-		ptr = kalloc_heap(heaps[i], size);
-	}
-		
-	return ptr;
+	return (FreeChunk*)ChunkAlignUp((offset_t)heap + sizeof(Heap));
 }
 
-void* kalloc_heap(Heap* heap, size_t size)
+static inline bool HeapIsIdle(Heap* heap)
 {
-	FreeChunk* chunk = &heap->start;
+	FreeChunk* chunk = HeapFirstChunk(heap);
 	
-	// Go one further, we never allocate the heap chuck
-	chunk = chunk->next;
+	return (chunk->size & kChunkFree) && (void*)OFFSET(chunk, ChunkSize(chunk)) == (void*)heap->end;
+}
+
+//
+// Takes up to max idle heaps out, but keeps the first keep
+// ones. Nobody can reach the taken heaps anymore.
+//
+// @return the number of heaps taken
+//
+static uint32_t TakeIdleHeaps(uint32_t keep, Heap** taken, uint32_t max)
+{
+	uint32_t takenCount = 0;
+	uint32_t idleCount = 0;
 	
-	// Adjust size for our overhead
-	size += sizeof(UsedChunk);
+	uint32_t interrupts = LockHeaps();
 	
-	// Align our size
-	if (size & 0x7)
-		size = (size & (size_t)~0x7) + 8;
-
-	// Currently use the first fit strategy
-	// this is not really optimal, we'll use
-	// bins later one
-	while(chunk != heap->end) {
-		assert(chunk);
-		assert(chunk->size & kChunkFree);
-		// Do we fit exaclty?
-		if (ChunkSize(chunk) == size) {
-			// Adjust free chaining
-			chunk->prev->next = chunk->next;
-			if (chunk->next)
-				chunk->next->prev = chunk->prev;
-			
-			break; // Now transform our chunk
-		}
-		// Do we fit, and can at leas put FreeChunk it the remainder?
-		else if (ChunkSize(chunk) >= size + sizeof(FreeChunk)) {
-			FreeChunk* c = OFFSET(chunk, size);
-
-			c->size = (ChunkSize(chunk) - size) | kChunkFree;
-			c->prev = chunk->prev;
-			c->next = chunk->next;
-			chunk->prev->next = c;
-			if (chunk->next)
-				chunk->next->prev = c;
-			chunk->size = size;
-
-			break; // Now transform our chunk
+	for (uint32_t i = 0; i < heapsCount && takenCount < max;) {
+		Heap* heap = heaps[i];
+		
+		if (heap->pageCount == 0 || !HeapIsIdle(heap) || idleCount++ < keep) {
+			i++;
+			continue;
 		}
-
-		chunk = chunk->next;
+		
+		// Take it out, keeping the order of the others
+		for (uint32_t j = i; j + 1 < heapsCount; j++)
+			heaps[j] = heaps[j + 1];
+		
+		heapsCount--;
+		taken[takenCount++] = heap;
 	}
 	
-	if (chunk == &heap->start || chunk == heap->end)
-		return NULL;
-	
-	// Clear free flag
-	chunk->size &= ~kChunkFree;
-	// Set used flag
-	chunk->size |= kChunkUsed;
+	UnlockHeaps(interrupts);
 	
-	assert(chunk != &heap->start && chunk != heap->end);
-	return OFFSET(chunk, sizeof(UsedChunk));
+	return takenCount;
 }
 
-void free(void* ptr)
+//
+// Gives back up to kTrimBatchSize idle heaps, but keeps
+// the first keep ones
+//
+// @return the number of pages given back
+//
+static size_t ReleaseIdleHeaps(uint32_t keep)
 {
-	for (uint32_t i = 0; i < heapsCount; i++) {
-		Heap* heap = heaps[i];
-		if ((void*)heap < ptr && ptr < (void*)heap->end) {
-			free_heap(heap, ptr);
-			return;
-		}
+	Heap* released[kTrimBatchSize];
+	uint32_t releasedCount = TakeIdleHeaps(keep, released, kTrimBatchSize);
+	size_t pageCount = 0;
+	
+	for (uint32_t i = 0; i < releasedCount; i++) {
+		Heap* heap = released[i];
+		
+		pageCount += heap->pageCount;
+		
+		PageOwnersClear(heap, heap->pageCount * kPhyMemPageSize);
+		PageReleaser(heap, heap->pageCount);
 	}
+	
+	return pageCount;
 }
 
-void free_heap(Heap* heap, void* ptr)
+//
+// Gives the chunks in the cache of the current cpu back
+// to their heaps
+//
+static void FlushCPUCache()
 {
-	// Adjust pointer
-	ptr = OFFSET(ptr, -sizeof(UsedChunk));
+	// Pick the cache only once we can not move to another cpu
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	CPUCache* cache = &CPUCaches[CPUGetCurrentNumber()];
 	
-	UsedChunk* chunk = ptr;
-	assert(chunk->size & kChunkUsed);
+	DrainRemoteFrees(cache);
 	
-	FreeChunk* next;
+	uint32_t heapsInterrupts = LockHeaps();
 	
-	// Find free next Chunk
-	next = OFFSET(ptr, ChunkSize(chunk));
-	while (next->size & kChunkUsed)
-		next = OFFSET(next, ChunkSize(next));
-	
-	// Found the next free chunk
-	// Is that adjacent at our end?
-	if (next == OFFSET(ptr, ChunkSize(chunk)) && next != heap->end) {
-		// Maybe we're adjacent to the chunk before?
-		if (OFFSET(next->prev, ChunkSize(next->prev)) == ptr && next->prev != &heap->start) {
-			// Woah great, just conceal us :)
-			// expand the size
-			next->prev->size += ChunkSize(next) + ChunkSize(next);
-			// Remove the next node from the list
-			next->prev->next = next->next;
-			next->next->prev = next->prev;
-		}
-		// Well at least we can conceal with the chunk behind
-		else {
-			FreeChunk* c = ptr;
-			// Mark free
-			c->size &= ~ChunkFlagsMask;
-			c->size |= kChunkFree;
-			
-			// Expand size
-			c->size += ChunkSize(next);
+	for (uint32_t i = 0; i < kSmallBinCount; i++) {
+		while (cache->chunks[i]) {
+			FreeChunk* chunk = cache->chunks[i];
 			
-			// Add to chain, remove next
-			next->prev->next = c;
-			c->prev = next->prev;
-			next->next->prev = c;
-			c->next = next->next;
+			cache->chunks[i] = chunk->next;
+			free_heaps(OFFSET(chunk, sizeof(UsedChunk)));
 		}
+		
+		cache->counts[i] = 0;
 	}
-	// Are we adjacent at our front?
-	else if (OFFSET(next->prev, ChunkSize(next->prev)) == ptr && next->prev != &heap->start) {
-		// Only need to expand the chunk, that's easy!
-		next->prev->size += ChunkSize(chunk);
-	}
-	// No one loves us, we're alone
-	else {
-		FreeChunk* c = ptr;
-		// Mark free
-		c->size &= ~ChunkFlagsMask;
-		c->size |= kChunkFree;
+	
+	UnlockHeaps(heapsInterrupts);
+	RestoreInterrupts(interrupts);
+}
+
+size_t KallocTrim()
+{
+	size_t pageCount = 0;
+	size_t released;
+	
+	if (PageReleaser == NULL)
+		return 0;
+	
+	FlushCPUCache();
+	
+	do {
+		released = ReleaseIdleHeaps(0);
+		pageCount += released;
+	} while (released > 0);
+	
+	return pageCount;
+}
+
+static bool TrimIdleHeaps()
+{
+	TrimmedPages* left = &TrimmedPagesLeft[CPUGetCurrentNumber()];
+	
+	if (left->pageCount == 0) {
+		Heap* heap;
+		
+		if (!TrimPending || PageReleaser == NULL)
+			return false;
 		
-		// Add us to chaining
-		next->prev->next = c;
-		c->prev = next->prev;
-		next->prev = c;
-		c->next = next;
+		TrimPending = false;
+		
+		if (TakeIdleHeaps(kKeptIdleHeaps, &heap, 1) == 0)
+			return false;
+		
+		// There may be more
+		TrimPending = true;
+		
+		left->address = heap;
+		left->pageCount = heap->pageCount;
 	}
+	
+	// Give back the end first, the start stays where it is
+	size_t count = left->pageCount < kTrimPagesPerCall ? left->pageCount : kTrimPagesPerCall;
+	
+	left->pageCount -= count;
+	
+	void* pages = OFFSET(left->address, left->pageCount * kPhyMemPageSize);
+	
+	PageOwnersClear(pages, count * kPhyMemPageSize);
+	PageReleaser(pages, count);
+	
+	return left->pageCount > 0 || TrimPending;
+}
+
+IdleRegisterHandler(TrimIdleHeaps);
+
+static Heap* _KallocInitializeHeap(void* ptr, size_t size)
+{
+	FreeChunk* chunk;
+	
+	// Use the heap as storage for the heap structure
+	Heap* heap = ptr;
+	
+	// Larger chunks could not be represented
+	if (size > kMaxHeapSize)
+		size = kMaxHeapSize;
+	
+	heap->owner.free = HeapFree;
+	heap->pageCount = 0;
+	
+	// The start chunk is sized to contain the heap
+	// structure, the first real chunk follows it
+	chunk = (FreeChunk*)ChunkAlignUp((offset_t)ptr + sizeof(Heap));
+	heap->start.size = ((size_t)((char*)chunk - (char*)ptr) & ~ChunkFlagsMask) | kChunkUsed;
+	
+	for (uint32_t i = 0; i < kSmallBinCount; i++)
+		heap->smallBins[i] = NULL;
+	for (uint32_t i = 0; i < kLargeBinCount; i++)
+		heap->largeBins[i] = NULL;
+	heap->smallBinMap = 0;
+	for (uint32_t i = 0; i < kLargeBinMapWords; i++)
+		heap->largeBinMap[i] = 0;
+	
+	// The end chunk is just a dummy chunk, marked used
+	// so nothing ever merges with it
+	heap->end = (UsedChunk*)ChunkAlignDown((offset_t)ptr + size - kMinChunkSize);
+	heap->end->size = kMinChunkSize | kChunkUsed;
+	
+	// Now configure our real free chunk
+	chunk->size = (size_t)((char*)heap->end - (char*)chunk);
+	ChunkMarkFree(chunk);
+	
+	BinInsert(heap, chunk);
+	
+	assert(PageOwnersSet(ptr, size, &heap->owner));
+		
+	return heap;
+}
+
+//
+// Moves the chunks other cpus freed into the cache, or back
+// into the heaps if the cache is full.
+//
+static void DrainRemoteFrees(CPUCache* cache)
+{
+	FreeChunk* chunk = __sync_lock_test_and_set(&cache->remoteFrees, NULL);
+	
+	while (chunk) {
+		FreeChunk* next = chunk->next;
+		uint32_t index = (uint32_t)(ChunkSize(chunk) >> 3);
+		
+		if (cache->counts[index] < kCPUCacheDepth) {
+			chunk->next = cache->chunks[index];
+			cache->chunks[index] = chunk;
+			cache->counts[index]++;
+		}
+		else {
+			uint32_t interrupts = LockHeaps();
+			free_heaps(OFFSET(chunk, sizeof(UsedChunk)));
+			UnlockHeaps(interrupts);
+		}
+		
+		chunk = next;
+	}
+}
+
+#ifdef KALLOC_PROFILE
+//
+// Profiling
+// =========
+//
+// With KALLOC_PROFILE defined, an allocation is sampled about every
+// kProfileSampleInterval bytes, and accounted to the site which
+// called kalloc. Sampled chunks keep the index of their site in
+// their last word, so it is known again when they are freed.
+//
+// Every sample stands for kProfileSampleInterval allocated bytes.
+// Allocations large enough to get pages of their own count towards
+// the interval, but are never sampled.
+//
+// The profile is logged while idle, every kProfileLogSamples new
+// samples. Idle handlers run with interrupts off, so only
+// kProfileLogBatch sites are logged per call.
+//
+static const int32_t kProfileSampleInterval = 16 * 1024;
+static const uint32_t kProfileSiteCount = 256;
+static const uint32_t kProfileLogSamples = 4096;
+static const uint32_t kProfileLogBatch = 8;
+
+typedef struct {
+	const void* address;
+	// Sampled chunks not freed yet
+	uint32_t liveSamples;
+	// All sampled chunks
+	uint32_t totalSamples;
+	uint32_t totalBytes;
+} ProfileSite;
+
+static ProfileSite ProfileSites[kProfileSiteCount];
+static int32_t BytesUntilSample[kCPUMaxCount];
+// Samples lost because the site table was full
+static uint32_t ProfileDroppedSamples;
+// All samples taken, and how many of them were logged
+static uint32_t ProfileSamples;
+static uint32_t ProfileLoggedSamples;
+// Whether every cpu is logging the profile while idle,
+// and the site it goes on with
+static bool ProfileLogging[kCPUMaxCount];
+static uint32_t ProfileLogCursor[kCPUMaxCount];
+
+//
+// Sampled chunks keep the index of their site in their last word
+//
+static inline uint32_t* ProfileSiteIndex(UsedChunk* chunk)
+{
+	return (uint32_t*)OFFSET(chunk, ChunkSize(chunk) - sizeof(uint32_t));
+}
+
+static inline bool ProfileShouldSample(size_t size)
+{
+	int32_t* bytes = &BytesUntilSample[CPUGetCurrentNumber()];
+	
+	*bytes -= (int32_t)size;
+	
+	if (*bytes > 0)
+		return false;
+	
+	*bytes = kProfileSampleInterval;
+	
+	return true;
+}
+
+//
+// Finds the slot of a site, or takes a free one
+//
+static uint32_t ProfileFindSite(const void* address)
+{
+	uint32_t index = ((offset_t)address >> 2) % kProfileSiteCount;
+	
+	for (uint32_t i = 0; i < kProfileSiteCount; i++) {
+		ProfileSite* site = &ProfileSites[index];
+		
+		if (site->address == address)
+			return index;
+		
+		if (site->address == NULL && __sync_bool_compare_and_swap(&site->address, NULL, address))
+			return index;
+		
+		// Someone else may just have taken it for us
+		if (site->address == address)
+			return index;
+		
+		index = (index + 1) % kProfileSiteCount;
+	}
+	
+	return kProfileSiteCount;
+}
+
+static void* ProfileAllocate(size_t size, const void* address)
+{
+	uint32_t index = ProfileFindSite(address);
+	
+	if (index == kProfileSiteCount) {
+		__sync_fetch_and_add(&ProfileDroppedSamples, 1);
+		return NULL;
+	}
+	
+	// Room for the site index
+	void* ptr = AllocateFromHeaps(size + sizeof(uint32_t), 0);
+	
+	if (ptr == NULL)
+		return NULL;
+	
+	UsedChunk* chunk = OFFSET(ptr, -sizeof(UsedChunk));
+	ProfileSite* site = &ProfileSites[index];
+	uint32_t chunkSize = (uint32_t)ChunkSize(chunk);
+	
+	*ProfileSiteIndex(chunk) = index;
+	
+	// Neighbours may change our flags meanwhile
+	__sync_fetch_and_or(&chunk->size, kChunkSampled);
+	
+	__sync_fetch_and_add(&site->liveSamples, 1);
+	__sync_fetch_and_add(&site->totalSamples, 1);
+	__sync_fetch_and_add(&site->totalBytes, chunkSize);
+	__sync_fetch_and_add(&ProfileSamples, 1);
+	
+	return ptr;
+}
+
+static void ProfileFree(UsedChunk* chunk)
+{
+	if (!(chunk->size & kChunkSampled))
+		return;
+	
+	ProfileSite* site = &ProfileSites[*ProfileSiteIndex(chunk)];
+	
+	__sync_fetch_and_and(&chunk->size, ~kChunkSampled);
+	
+	__sync_fetch_and_sub(&site->liveSamples, 1);
+}
+
+static void LogProfileHeader()
+{
+	LogInfo("kalloc: one sample every %d bytes, %d samples dropped", kProfileSampleInterval, ProfileDroppedSamples);
+}
+
+//
+// Logs the sites from first on, up to count of those
+// which have samples
+//
+// @return the site to go on with
+//
+static uint32_t LogProfileSites(uint32_t first, uint32_t count)
+{
+	uint32_t i;
+	
+	for (i = first; i < kProfileSiteCount && count > 0; i++) {
+		ProfileSite* site = &ProfileSites[i];
+		
+		if (site->totalSamples == 0)
+			continue;
+		
+		LogInfo("kalloc: %p live ~%d KiB in %d samples, total ~%d KiB in %d samples, %d bytes average", site->address,
+		        site->liveSamples * (kProfileSampleInterval / 1024), site->liveSamples,
+		        site->totalSamples * (kProfileSampleInterval / 1024), site->totalSamples,
+		        site->totalBytes / site->totalSamples);
+		count--;
+	}
+	
+	return i;
+}
+
+void LogKallocProfile()
+{
+	LogProfileHeader();
+	LogProfileSites(0, kProfileSiteCount);
+}
+
+static bool LogProfileWhileIdle()
+{
+	uint32_t cpu = CPUGetCurrentNumber();
+	
+	if (!ProfileLogging[cpu]) {
+		uint32_t logged = ProfileLoggedSamples;
+		uint32_t samples = ProfileSamples;
+		
+		// Only one cpu logs every batch of samples
+		if (samples - logged < kProfileLogSamples ||
+		    !__sync_bool_compare_and_swap(&ProfileLoggedSamples, logged, samples))
+			return false;
+		
+		LogProfileHeader();
+		ProfileLogging[cpu] = true;
+		ProfileLogCursor[cpu] = 0;
+	}
+	
+	ProfileLogCursor[cpu] = LogProfileSites(ProfileLogCursor[cpu], kProfileLogBatch);
+	ProfileLogging[cpu] = ProfileLogCursor[cpu] < kProfileSiteCount;
+	
+	return ProfileLogging[cpu];
+}
+
+IdleRegisterHandler(LogProfileWhileIdle);
+#endif
+
+void* kalloc(size_t size)
+{
+	return kalloc_caller(size, __builtin_return_address(0));
+}
+
+void* kalloc_caller(size_t size, const void* caller)
+{
+	void* ptr = NULL;
+	size_t chunkSize = ChunkSizeForRequest(size);
+	
+#ifdef KALLOC_PROFILE
+	// Page allocations have no room for the site
+	if (ProfileShouldSample(size) && chunkSize < kPageAllocationSize) {
+		ptr = ProfileAllocate(size, caller);
+		
+		if (ptr)
+			return ptr;
+	}
+#else
+	(void)caller;
+#endif
+	
+	if (chunkSize < kSmallBinLimit) {
+		uint32_t index = (uint32_t)(chunkSize >> 3);
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		CPUCache* cache = &CPUCaches[CPUGetCurrentNumber()];
+		
+		if (cache->chunks[index] == NULL && cache->remoteFrees != NULL)
+			DrainRemoteFrees(cache);
+		
+		FreeChunk* chunk = cache->chunks[index];
+		
+		if (chunk) {
+			cache->chunks[index] = chunk->next;
+			cache->counts[index]--;
+			ptr = OFFSET(chunk, sizeof(UsedChunk));
+		}
+		
+		RestoreInterrupts(interrupts);
+		
+		if (ptr)
+			return ptr;
+	}
+	
+	// Large allocations get pages of their own, so they
+	// do not fragment the heaps
+	if (chunkSize >= kPageAllocationSize) {
+		ptr = kalloc_pages((size + kPhyMemPageSize - 1) / kPhyMemPageSize);
+		
+		if (ptr)
+			return ptr;
+	}
+	
+	return AllocateFromHeaps(size, 0);
+}
+
+//
+// Allocates from the heaps and grows them if needed. An align
+// of 0 means the natural alignment of chunks.
+//
+static void* AllocateFromHeaps(size_t size, size_t align)
+{
+	void* ptr = NULL;
+	size_t chunkSize = ChunkSizeForRequest(size);
+	
+	if (align)
+		chunkSize += align + kMinChunkSize;
+	
+	do {
+		uint32_t interrupts = LockHeaps();
+		uint32_t cpu = CPUGetCurrentNumber();
+		
+		for (uint32_t i = 0; i < heapsCount && ptr == NULL; i++) {
+			if (align)
+				ptr = kalloc_heap_aligned(heaps[i], size, align);
+			else
+				ptr = kalloc_heap(heaps[i], size);
+		}
+		
+		// Set the owner while no neighbour can change
+		// our flags
+		if (ptr) {
+			UsedChunk* chunk = OFFSET(ptr, -sizeof(UsedChunk));
+			chunk->size |= cpu << kChunkOwnerShift;
+		}
+		
+		UnlockHeaps(interrupts);
+	} while (ptr == NULL && GrowHeaps(chunkSize));
+		
+	return ptr;
+}
+
+void* kalloc_aligned(size_t size, size_t align)
+{
+	assert((align & (align - 1)) == 0);
+	
+	// Chunks are always aligned this far
+	if (align <= 8)
+		return kalloc(size);
+	
+	if (align == kPhyMemPageSize && ChunkSizeForRequest(size) >= kPageAllocationSize) {
+		void* ptr = kalloc_pages((size + kPhyMemPageSize - 1) / kPhyMemPageSize);
+		
+		if (ptr)
+			return ptr;
+	}
+	
+	return AllocateFromHeaps(size, align);
+}
+
+//
+// Allocates a chunk whose memory is aligned to align by
+// taking a larger one and giving back what is in front
+// of and behind the aligned part
+//
+static void* kalloc_heap_aligned(Heap* heap, size_t size, size_t align)
+{
+	void* ptr = kalloc_heap(heap, size + align + kMinChunkSize);
+	
+	if (ptr == NULL)
+		return NULL;
+	
+	FreeChunk* chunk = OFFSET(ptr, -sizeof(UsedChunk));
+	offset_t aligned = ((offset_t)ptr + align - 1) & ~(offset_t)(align - 1);
+	
+	// The gap has to hold a free chunk
+	if (aligned != (offset_t)ptr && aligned - (offset_t)ptr < kMinChunkSize)
+		aligned += align;
+	
+	if (aligned != (offset_t)ptr) {
+		size_t gap = aligned - (offset_t)ptr;
+		FreeChunk* front = chunk;
+		
+		chunk = OFFSET(front, gap);
+		chunk->size = (ChunkSize(front) - gap) | kChunkUsed;
+		front->size = gap | kChunkUsed;
+		
+		free_heap(heap, OFFSET(front, sizeof(UsedChunk)));
+	}
+	
+	size_t chunkSize = ChunkSizeForRequest(size);
+	
+	if (ChunkSize(chunk) >= chunkSize + kMinChunkSize) {
+		FreeChunk* back = OFFSET(chunk, chunkSize);
+		
+		back->size = (ChunkSize(chunk) - chunkSize) | kChunkUsed;
+		chunk->size = chunkSize | (chunk->size & ChunkFlagsMask);
+		
+		free_heap(heap, OFFSET(back, sizeof(UsedChunk)));
+	}
+	
+	return (void*)aligned;
+}
+
+//
+// Page allocations
+// ================
+//
+// Pages from kalloc_pages come straight from the page provider.
+// Every allocation owns its pages, so free finds how many pages
+// to give back.
+//
+typedef struct {
+	PageOwner owner;
+	void* address;
+	size_t pageCount;
+} PageAllocation;
+
+void* kalloc_pages(size_t count)
+{
+	if (PageProvider == NULL || count == 0)
+		return NULL;
+	
+	PageAllocation* allocation = AllocateFromHeaps(sizeof(PageAllocation), 0);
+	
+	if (allocation == NULL)
+		return NULL;
+	
+	void* address = PageProvider(count);
+	
+	// Idle heaps may hold the memory we need
+	if (address == NULL && KallocTrim() > 0)
+		address = PageProvider(count);
+	
+	if (address == NULL) {
+		free(allocation);
+		return NULL;
+	}
+	
+	allocation->owner.free = PagesFree;
+	allocation->address = address;
+	allocation->pageCount = count;
+	
+	if (!PageOwnersSet(address, count * kPhyMemPageSize, &allocation->owner)) {
+		PageReleaser(address, count);
+		free(allocation);
+		return NULL;
+	}
+	
+	return address;
+}
+
+static void PagesFree(PageOwner* owner, void* ptr)
+{
+	PageAllocation* allocation = (PageAllocation*)owner;
+	
+	assert(ptr == allocation->address);
+	
+	PageOwnersClear(allocation->address, allocation->pageCount * kPhyMemPageSize);
+	PageReleaser(allocation->address, allocation->pageCount);
+	free(allocation);
+}
+
+void* kalloc_heap(Heap* heap, size_t size)
+{
+	size = ChunkSizeForRequest(size);
+	
+	FreeChunk* chunk = BinFind(heap, size);
+	
+	if (chunk == NULL)
+		return NULL;
+	
+	assert(chunk->size & kChunkFree);
+	BinRemove(heap, chunk);
+	
+	// Can we put a FreeChunk in the remainder?
+	if (ChunkSize(chunk) >= size + kMinChunkSize) {
+		FreeChunk* c = OFFSET(chunk, size);
+		
+		c->size = ChunkSize(chunk) - size;
+		chunk->size = size;
+		ChunkMarkFree(c);
+		
+		BinInsert(heap, c);
+	}
+	else {
+		UsedChunk* next = (UsedChunk*)OFFSET(chunk, ChunkSize(chunk));
+		next->size &= ~kChunkPrevFree;
+	}
+	
+	// Clear free flag
+	chunk->size &= ~kChunkFree;
+	// Set used flag
+	chunk->size |= kChunkUsed;
+	
+	return OFFSET(chunk, sizeof(UsedChunk));
+}
+
+void free(void* ptr)
+{
+	if (ptr == NULL)
+		return;
+	
+	PageOwner* owner = PageOwnersGet(ptr);
+	
+	// Nobody allocated this
+	if (owner == NULL)
+		return;
+	
+	// Slabs and anything else not coming from a heap
+	if (owner->free != HeapFree) {
+		owner->free(owner, ptr);
+		return;
+	}
+	
+	UsedChunk* chunk = OFFSET(ptr, -sizeof(UsedChunk));
+	
+#ifdef KALLOC_PROFILE
+	ProfileFree(chunk);
+#endif
+	
+	if (ChunkSize(chunk) < kSmallBinLimit && CacheChunk(chunk, ChunkSize(chunk)))
+		return;
+	
+	HeapFree(owner, ptr);
+}
+
+void kfree_sized(void* ptr, size_t size)
+{
+	size_t chunkSize = ChunkSizeForRequest(size);
+	
+	// Only those may come from kalloc_pages
+	if (ptr == NULL || chunkSize >= kPageAllocationSize) {
+		free(ptr);
+		return;
+	}
+	
+	UsedChunk* chunk = OFFSET(ptr, -sizeof(UsedChunk));
+	
+#ifdef KALLOC_PROFILE
+	ProfileFree(chunk);
+#endif
+	
+	// Cached by this cpu without looking at the chunk. It may
+	// be larger than requested, caching it for the requested
+	// size is fine.
+	if (chunkSize < kSmallBinLimit && CacheLocalChunk(chunk, chunkSize))
+		return;
+	
+	HeapFree(PageOwnersGet(ptr), ptr);
+}
+
+//
+// Puts a small chunk into the cache of the cpu owning it
+//
+// @return false if the cache is full
+//
+static bool CacheChunk(UsedChunk* chunk, size_t chunkSize)
+{
+	uint32_t cpu = CPUGetCurrentNumber();
+	CPUCache* cache = &CPUCaches[ChunkOwner(chunk)];
+	FreeChunk* freeChunk = (FreeChunk*)chunk;
+	
+	// Not ours, let the owner deal with it
+	if (ChunkOwner(chunk) != cpu) {
+		FreeChunk* head;
+		
+		do {
+			head = cache->remoteFrees;
+			freeChunk->next = head;
+		} while (!__sync_bool_compare_and_swap(&cache->remoteFrees, head, freeChunk));
+		
+		return true;
+	}
+	
+	return CacheLocalChunk(chunk, chunkSize);
+}
+
+//
+// Puts a small chunk into the cache of the current cpu, no
+// matter which cpu allocated it. Chunks keep their owner, a
+// later free hands them back to it.
+//
+// @return false if the cache is full
+//
+static bool CacheLocalChunk(UsedChunk* chunk, size_t chunkSize)
+{
+	FreeChunk* freeChunk = (FreeChunk*)chunk;
+	uint32_t index = (uint32_t)(chunkSize >> 3);
+	bool cached = false;
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	CPUCache* cache = &CPUCaches[CPUGetCurrentNumber()];
+	
+	if (cache->counts[index] < kCPUCacheDepth) {
+		freeChunk->next = cache->chunks[index];
+		cache->chunks[index] = freeChunk;
+		cache->counts[index]++;
+		cached = true;
+	}
+	
+	RestoreInterrupts(interrupts);
+	
+	return cached;
+}
+
+void* krealloc(void* ptr, size_t size)
+{
+	const void* caller = __builtin_return_address(0);
+	
+	if (ptr == NULL)
+		return kalloc_caller(size, caller);
+	
+	PageOwner* owner = PageOwnersGet(ptr);
+	size_t oldSize;
+	
+	assert(owner != NULL);
+	
+	if (owner->free == PagesFree) {
+		PageAllocation* allocation = (PageAllocation*)owner;
+		
+		oldSize = allocation->pageCount * kPhyMemPageSize;
+		
+		// Small requests never get pages of their own
+		if (size <= oldSize && ChunkSizeForRequest(size) >= kPageAllocationSize)
+			return ptr;
+	}
+	else {
+		assert(owner->free == HeapFree);
+		
+		UsedChunk* chunk = OFFSET(ptr, -sizeof(UsedChunk));
+		size_t chunkSize = ChunkSizeForRequest(size);
+		
+#ifdef KALLOC_PROFILE
+		// A sampled chunk stays sampled, its site index
+		// moves to the new end of the chunk
+		uint32_t siteIndex = 0;
+		bool sampled = (chunk->size & kChunkSampled) != 0;
+		
+		if (sampled) {
+			siteIndex = *ProfileSiteIndex(chunk);
+			chunkSize = ChunkSizeForRequest(size + sizeof(uint32_t));
+		}
+#endif
+		
+		uint32_t interrupts = LockHeaps();
+		bool resized = ResizeChunk((Heap*)owner, chunk, chunkSize);
+		
+#ifdef KALLOC_PROFILE
+		if (resized && sampled)
+			*ProfileSiteIndex(chunk) = siteIndex;
+#endif
+		
+		oldSize = ChunkSize(chunk) - sizeof(UsedChunk);
+		UnlockHeaps(interrupts);
+		
+		if (resized)
+			return ptr;
+	}
+	
+	// Move it
+	void* newPtr = kalloc_caller(size, caller);
+	
+	if (newPtr == NULL)
+		return NULL;
+	
+	memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+	free(ptr);
+	
+	return newPtr;
+}
+
+//
+// Resizes a used chunk in place, growing into the free chunk
+// behind it if needed. What is not needed anymore is given
+// back. Must be called with the heaps locked.
+//
+// @return false if the chunk could not grow
+//
+static bool ResizeChunk(Heap* heap, UsedChunk* chunk, size_t size)
+{
+	FreeChunk* next = OFFSET((FreeChunk*)chunk, ChunkSize(chunk));
+	
+	if (size > ChunkSize(chunk)) {
+		if (!(next->size & kChunkFree) || ChunkSize(chunk) + ChunkSize(next) < size)
+			return false;
+		
+		BinRemove(heap, next);
+		chunk->size += ChunkSize(next);
+		
+		next = OFFSET((FreeChunk*)chunk, ChunkSize(chunk));
+		next->size &= ~kChunkPrevFree;
+	}
+	
+	// Give the rest back, merging it with what follows
+	if (ChunkSize(chunk) >= size + kMinChunkSize) {
+		FreeChunk* back = OFFSET((FreeChunk*)chunk, size);
+		
+		back->size = (ChunkSize(chunk) - size) | kChunkUsed;
+		chunk->size = size | (chunk->size & (ChunkFlagsMask | kChunkTagMask));
+		
+		free_heap(heap, OFFSET(back, sizeof(UsedChunk)));
+	}
+	
+	return true;
+}
+
+static void HeapFree(PageOwner* owner, void* ptr)
+{
+	Heap* heap = (Heap*)owner;
+	uint32_t interrupts = LockHeaps();
+	
+	free_heap(heap, ptr);
+	
+	if (heap->pageCount && HeapIsIdle(heap))
+		TrimPending = true;
+	
+	UnlockHeaps(interrupts);
+}
+
+//
+// Gives a chunk back to the heap owning it. Must be called
+// with the heaps locked.
+//
+static void free_heaps(void* ptr)
+{
+	free_heap((Heap*)PageOwnersGet(ptr), ptr);
+}
+
+void free_heap(Heap* heap, void* ptr)
+{
+	// Adjust pointer
+	ptr = OFFSET(ptr, -sizeof(UsedChunk));
+	
+	FreeChunk* chunk = ptr;
+	assert(chunk->size & kChunkUsed);
+	
+	// Free chunks have no owner
+	chunk->size &= ~kChunkTagMask;
+	
+	// Merge with the chunk behind us
+	FreeChunk* next = OFFSET(chunk, ChunkSize(chunk));
+	if (next->size & kChunkFree) {
+		BinRemove(heap, next);
+		chunk->size += ChunkSize(next);
+	}
+	
+	// Merge with the chunk in front of us, its footer
+	// tells us where it starts
+	if (chunk->size & kChunkPrevFree) {
+		size_t prevSize = *(size_t*)OFFSET(chunk, -sizeof(size_t));
+		FreeChunk* prev = OFFSET(chunk, -prevSize);
+		
+		assert(prev->size & kChunkFree);
+		BinRemove(heap, prev);
+		prev->size += ChunkSize(chunk);
+		chunk = prev;
+	}
+	
+	// Mark free
+	chunk->size &= ~ChunkFlagsMask;
+	ChunkMarkFree(chunk);
+	
+	BinInsert(heap, chunk);
 }
@@ -38,21 +38,99 @@ void KallocInitialize(void* ptr, size_t size);
 //
 // Adds a new heap space to Kalloc.
 //
-// TODO: as this heap can probbably grow/shrink
-// we may need to provide some callbacks here
-//
 void KallocAddHeap(void* ptr, size_t size);
 
 //
-// Allocates memory at least of the size specified
+// Maps count fresh pages and returns the address of the
+// first one, or NULL if there is no memory left.
+//
+typedef void* (*KallocPageProvider)(size_t count);
+
+//
+// Unmaps count pages handed out by the provider. Larger
+// ranges may be given back in parts.
+//
+typedef void (*KallocPageReleaser)(void* address, size_t count);
+
+//
+// Sets the functions used to get more memory when all heaps
+// are exhausted, and for page allocations.
+//
+// Until a provider is set kalloc only uses the heaps added
+// by hand.
+//
+void KallocSetPageProvider(KallocPageProvider provider, KallocPageReleaser releaser);
+
+//
+// Gives the pages of all completely free heaps back to the page
+// provider. Call this when memory runs low, otherwise heaps are
+// trimmed while the cpu is idle.
+//
+// @return the number of pages given back
+//
+size_t KallocTrim();
+
+//
+// Allocates memory at least of the size specified. The memory
+// is 8 byte aligned.
 //
 void* kalloc(size_t size);
 
+//
+// Same as kalloc, but the profiler accounts the allocation to
+// caller instead of the function calling kalloc_caller. Used by
+// allocators built on top of kalloc to pass on their caller.
+//
+void* kalloc_caller(size_t size, const void* caller);
+
+//
+// Allocates memory aligned to align, which has to be a
+// power of two
+//
+void* kalloc_aligned(size_t size, size_t align);
+
+//
+// Allocates count pages mapped just for this allocation. They
+// are freed with free like any other allocation.
+//
+// @return the page aligned address or NULL if there is no page
+//         provider yet or no memory left
+//
+void* kalloc_pages(size_t count);
+
+//
+// Resizes an allocation, in place if the memory behind it is
+// free. Otherwise the contents are moved to a new allocation.
+//
+// @return the resized allocation or NULL if there is no memory
+//         left, in which case ptr stays valid
+//
+void* krealloc(void* ptr, size_t size);
+
 //
 // Frees the allocated memory
 //
 void free(void* ptr);
 
+//
+// Frees memory allocated by kalloc, kalloc_aligned or krealloc
+// with the size passed to it. Knowing the size saves looking at
+// the memory and up who owns it, small allocations go straight
+// into the cache of the current cpu.
+//
+void kfree_sized(void* ptr, size_t size);
+
+#ifdef KALLOC_PROFILE
+//
+// Logs the estimated live and total bytes of every
+// site the profiler has seen. This is done while idle
+// whenever enough new samples came in.
+//
+void LogKallocProfile();
+#else
+static inline void LogKallocProfile() {}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
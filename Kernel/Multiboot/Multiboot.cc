@@ -53,28 +53,92 @@ void _MultibootAdjust(struct Multiboot* multiboot, offset_t offset)
 	#undef ADJUST
 }
 
-void MultibootInitializePhyMem(struct Multiboot* multiboot, offset_t phyOffset)
+//
+// Gets the part of an entry describing available ram we can address
+//
+// @return false if the entry is not usable
+//
+static bool GetAvailableRange(struct MultibootMMapEntry* entry, uint32_t* base, uint32_t* end)
 {
-	PhyMemInitialize();
+	// We can only address the lower 4GB
+	if (entry->type != 1 || entry->base_address >= kUInt32Max)
+		return false;
 	
-	LogTrace("Account available ram reported by multiboot");
-	struct MultibootMMapEntry* entry;
+	uint64_t entryEnd = entry->base_address + entry->length;
+	
+	if (entryEnd > kUInt32Max)
+		entryEnd = kUInt32Max;
+	
+	*base = (uint32_t)entry->base_address;
+	*end = (uint32_t)entryEnd;
+	
+	return *end > *base;
+}
+
+//
+// Gets the entry after a given one, or NULL at the end of the map
+//
+static struct MultibootMMapEntry* NextMMapEntry(struct Multiboot* multiboot, struct MultibootMMapEntry* entry)
+{
+	entry = (struct MultibootMMapEntry*)((uint32_t)entry + entry->size + 4);
 	
-	entry  = multiboot->mmap_addr;
+	if ((uint32_t)entry >= (uint32_t)multiboot->mmap_addr + multiboot->mmap_length)
+		return NULL;
+	
+	return entry;
+}
 
-	while ((uint32_t)entry < (uint32_t)multiboot->mmap_addr + multiboot->mmap_length) {
-		if (entry->type == 1) {
-			for (pointer_t address = (pointer_t)(uint32_t)entry->base_address; 
-			     address < (pointer_t)(uint32_t)(entry->base_address + entry->length);
-			     address = OFFSET(address, kPhyMemPageSize)) {
-				_PhyMemMarkFree(address);	
-			}
-		}
+void MultibootInitializePhyMem(struct Multiboot* multiboot, offset_t phyOffset)
+{
+	struct MultibootMMapEntry* entry;
+	uint32_t base, end;
+	
+	LogTrace("Find top of available ram reported by multiboot");
+	uint32_t pageCount = 0;
+	
+	for (entry = multiboot->mmap_addr; entry != NULL; entry = NextMMapEntry(multiboot, entry)) {
+		if (GetAvailableRange(entry, &base, &end) && end / kPhyMemPageSize > pageCount)
+			pageCount = end / kPhyMemPageSize;
+	}
+	
+	// Place the bitmaps at the end of the highest range which
+	// can hold them, far away from the kernel and bootstrap
+	size_t bitmapSize = PhyMemGetBitmapSize(pageCount);
+	uint32_t bitmapAddress = 0;
+	
+	for (entry = multiboot->mmap_addr; entry != NULL; entry = NextMMapEntry(multiboot, entry)) {
+		if (!GetAvailableRange(entry, &base, &end) || end - base < bitmapSize)
+			continue;
+		
+		uint32_t address = (end - bitmapSize) & kPhyPageMask;
 		
-		entry = (struct MultibootMMapEntry*)((uint32_t)entry + entry->size + 4);
+		if (address >= base && address > bitmapAddress)
+			bitmapAddress = address;
 	}
 	
+	assert(bitmapAddress != 0);
+	
+	BooststrapMap(bitmapAddress, kBootstrapPhyMemBitmapAddress, bitmapSize);
+	PhyMemInitialize(pageCount, (pointer_t)kBootstrapPhyMemBitmapAddress, (page_t)bitmapAddress);
+	
+	LogTrace("Account available ram reported by multiboot");
+	for (entry = multiboot->mmap_addr; entry != NULL; entry = NextMMapEntry(multiboot, entry)) {
+		if (GetAvailableRange(entry, &base, &end))
+			_PhyMemAddAvailableRange((page_t)base, end - base);
+	}
+	
+	_PhyMemMarkUsedRange((page_t)bitmapAddress, bitmapSize);
+	
 	LogTrace("Account phys pages used by multiboot structure");
 	// TODO: we need to adjust the other structure too
 	_PhyMemMarkUsedRange(OFFSET(multiboot, -phyOffset), sizeof(struct Multiboot));
 }
+
+uint32_t MultibootGetPageCount(struct Multiboot* multiboot)
+{
+	// mem_upper is only valid with flag 0
+	assert(multiboot->flags & (1 << 0));
+	
+	// mem_upper counts the KiB starting at 1 MiB
+	return (uint32_t)(((uint64_t)multiboot->mem_upper + 1024) / (kPhyMemPageSize / 1024));
+}
@@ -91,6 +91,12 @@ void _MultibootAdjust(struct Multiboot* multiboot, offset_t offset);
 //
 void MultibootInitializePhyMem(struct Multiboot* multiboot, offset_t phyOffset);
 
+//
+// Returns the number of pages up to the top of upper
+// memory as reported by the bootloader.
+//
+uint32_t MultibootGetPageCount(struct Multiboot* multiboot);
+
 #ifdef __cplusplus
 }
 #endif
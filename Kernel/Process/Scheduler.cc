@@ -56,6 +56,8 @@ Ptr<Thread> GetCurrentThread()
 	return GlobalScheduler->getCurrentThread();
 }
 
+KOBJECT_CACHE(SchedulerItem);
+
 SchedulerItem::~SchedulerItem() 
 {
 }
@@ -69,14 +71,14 @@ Scheduler::~Scheduler()
 {
 }
 
-void Scheduler::removeThreadFromScheduling(Ptr<Thread> thread)
+void Scheduler::removeThreadFromScheduling(BorrowedPtr<Thread> thread)
 {
 	if (this->nextItem != NULL) {
 		if (this->nextItem->thread == thread) {
 			this->nextItem = this->nextItem->next;
 		}
 		else {
-			Ptr<SchedulerItem> item = this->nextItem;
+			BorrowedPtr<SchedulerItem> item = this->nextItem;
 
 			while (item->next) {
 				if (item->next->thread == thread) {
@@ -94,33 +96,41 @@ void Scheduler::addThreadToScheduling(Ptr<Thread> thread)
 	if (this->nextItem == NULL) {
 		this->nextItem = new SchedulerItem(thread);
 	}
-	Ptr<SchedulerItem> item = this->nextItem;
+	BorrowedPtr<SchedulerItem> item = this->nextItem;
 
 	while (item->next) item = item->next;
 
-	item->next = new SchedulerItem(thread);
+	item->next = new SchedulerItem(Move(thread));
 }
 
-void Scheduler::threadStateDidChange(Ptr<Thread> thread)
+void Scheduler::threadStateDidChange(BorrowedPtr<Thread> thread)
 {
-	this->removeThreadFromScheduling(thread);
-	this->addThreadToScheduling(thread);
+	// Removing it drops our reference, which may be the last one
+	Ptr<Thread> keep = thread;
+	
+	this->removeThreadFromScheduling(keep);
+	this->addThreadToScheduling(Move(keep));
 }
 
 const Interrupts::CPUState* Scheduler::schedule(const Interrupts::CPUState* state)
 {
+	// The kernel was finishing up an interrupt, it has to go on
+	if (Interrupts::IsHandlingNestedInterrupt()) {
+		this->timer->setTicks(kUInt16Max);
+		return state;
+	}
+	
 	// A thread ran, so save it's state
 	if (state && this->currentThread) {
 		this->currentThread->setCPUState(state);
-		this->addThreadToScheduling(this->currentThread);
-		this->currentThread = NULL;
+		this->addThreadToScheduling(Move(this->currentThread));
 	}
 
 	// We have an item to run
 	if (this->nextItem) {
-		Ptr<SchedulerItem> item = this->nextItem;
+		Ptr<SchedulerItem> item = Move(this->nextItem);
 
-		this->nextItem = this->nextItem->next;
+		this->nextItem = Move(item->next);
 
 		this->timer->setTicks(kUInt16Max);
 		return item->thread->getCPUState();
@@ -57,8 +57,10 @@ class SchedulerItem : public KObject
 public:
 	Ptr<Thread> thread;
 	Ptr<SchedulerItem> next;
-	SchedulerItem(Ptr<Thread> t) : thread(t), next(NULL) {}
+	SchedulerItem(Ptr<Thread> t) : thread(Move(t)), next(NULL) {}
 	virtual ~SchedulerItem();
+	
+	KOBJECT_CACHED
 };
 
 class Scheduler : public KObject
@@ -68,12 +70,12 @@ private:
 	Ptr<Thread> currentThread;
 	Ptr<Timer::Timer> timer;
 
-	void removeThreadFromScheduling(Ptr<Thread> thread);
+	void removeThreadFromScheduling(BorrowedPtr<Thread> thread);
 	void addThreadToScheduling(Ptr<Thread> thread);
 protected:
 	friend class Thread;
 	friend void TakeOff();
-	void threadStateDidChange(Ptr<Thread> thread);
+	void threadStateDidChange(BorrowedPtr<Thread> thread);
 public:
 	Scheduler();
 	virtual ~Scheduler();
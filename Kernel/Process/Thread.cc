@@ -32,8 +32,8 @@ Thread::Thread(uint32_t entryPoint, size_t stackSize, Ptr<Process> _process)
 {
 	#pragma unused(entryPoint, stackSize)
 	this->process = _process;
-	assert(this->process->thread != NULL);
-	this->process->thread = this;
+	assert(_process->thread != NULL);
+	_process->thread = this;
 	memset(&this->cpuState, 0, sizeof(sizeof(Interrupts::CPUState)));
 
 	// Start suspendes
@@ -47,7 +47,7 @@ Thread::~Thread()
 
 Ptr<Process> Thread::getProcess() const
 {
-	return this->process;
+	return this->process.lock();
 }
 
 void Thread::setCPUState(const Interrupts::CPUState* _state)
@@ -58,14 +58,14 @@ class Thread : public KObject
 {
 	Interrupts::CPUState cpuState;
 	// Weak pointer to holding process
-	Process* process;
+	WeakPtr<Process> process;
 	// The state this thread is in
 	ThreadState state;
 public:
 	Thread(uint32_t entryPoint, size_t stackSize, Ptr<Process> process);
 	virtual ~Thread();
 
-	// Gets the containing process
+	// Gets the containing process, NULL once it is gone
 	Ptr<Process> getProcess() const;
 
 	// Saves the cpu state of this thread
@@ -41,6 +41,8 @@ class Dictionary : public KObject {
 		Ptr<DictionaryNode> rightChild;
 		
 		DictionaryNode(Key _key, Value _value) : key(_key), value(_value) {}
+		
+		KOBJECT_CACHED
 	};
 
 private:
@@ -146,3 +148,7 @@ public:
 		}
 	}
 };
+
+// Every instantiation gets a cache of its own node size
+template<class Key, class Value>
+ObjectCache Dictionary<Key, Value>::DictionaryNode::objectCache("DictionaryNode", sizeof(DictionaryNode));
@@ -25,16 +25,25 @@
 #include "KObject.h"
 #include "Memory/kalloc.h"
 #include "Error/Panic.h"
+#include "Interrupts/Interrupts.h"
+#include "Utils/CPU.h"
+#include "Utils/DeferredRelease.h"
 
+#include <CoreSystem/MachineInstructions.h>
+
+//
+// The caller is passed on, so the profiler accounts
+// allocations to where new was used
+//
 void* operator new(size_t size)
 {
-	void* obj = kalloc(size);
+	void* obj = kalloc_caller(size, __builtin_return_address(0));
 	return obj;
 }
 
 void* operator new[](size_t size)
 {
-	return kalloc(size);
+	return kalloc_caller(size, __builtin_return_address(0));
 }
 
 void  operator delete(void* ptr)
@@ -47,8 +56,178 @@ void  operator delete[](void* ptr)
 	free(ptr);
 }
 
+void  operator delete(void* ptr, size_t size)
+{
+	kfree_sized(ptr, size);
+}
+
+void  operator delete[](void* ptr, size_t size)
+{
+	kfree_sized(ptr, size);
+}
+
 KObject::~KObject()
 {
+	KObjectWeakReference* reference = this->weakReference;
+	
+	// Tell the WeakPtrs we are gone. Our count is zero
+	// already, so none of them got a reference since.
+	if (reference != NULL) {
+		uint32_t interrupts = reference->lockObject();
+		reference->object = NULL;
+		reference->unlockObject(interrupts);
+		
+		reference->Release();
+	}
+}
+
+//
+// Deferred destruction
+// ====================
+//
+// Objects released inside an interrupt handler are not destroyed
+// there, as their destructors could run for long with interrupts
+// off. They are queued on the cpu instead and destroyed when the
+// outermost handler exits, with interrupts enabled again.
+//
+// The queue is bounded, once a handler released that many objects
+// the rest is destroyed right away rather than piling up.
+//
+
+static KObject* DeferredObjects[kCPUMaxCount];
+static uint32_t DeferredCount[kCPUMaxCount];
+static const uint32_t kMaxDeferredObjects = 64;
+
+void KObject::Destroy()
+{
+	if (Interrupts::IsHandlingInterrupt()) {
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		uint32_t cpu = CPUGetCurrentNumber();
+		bool deferred = DeferredCount[cpu] < kMaxDeferredObjects;
+		
+		if (deferred) {
+			this->nextDeferred = DeferredObjects[cpu];
+			DeferredObjects[cpu] = this;
+			DeferredCount[cpu]++;
+		}
+		
+		RestoreInterrupts(interrupts);
+		
+		if (deferred)
+			return;
+	}
+	
+	this->DestroyNow();
+}
+
+void KObject::DestroyNow()
+{
+	if (this->arenaAllocated)
+		this->~KObject();
+	else
+		delete this;
+}
+
+bool HasDeferredObjects()
+{
+	return DeferredObjects[CPUGetCurrentNumber()] != NULL;
+}
+
+void ReclaimDeferredObjects()
+{
+	uint32_t cpu = CPUGetCurrentNumber();
+	
+	while (true) {
+		// Handlers interrupting us may queue more
+		uint32_t interrupts = SaveAndDisableInterrupts();
+		KObject* object = DeferredObjects[cpu];
+		
+		if (object != NULL) {
+			DeferredObjects[cpu] = object->nextDeferred;
+			DeferredCount[cpu]--;
+		}
+		
+		RestoreInterrupts(interrupts);
+		
+		if (object == NULL)
+			break;
+		
+		object->DestroyNow();
+	}
+}
+
+//
+// Weak references
+// ===============
+//
+
+static ObjectCache WeakReferenceCache("KObjectWeakReference", sizeof(KObjectWeakReference), KObjectWeakReference::Construct);
+
+KObjectWeakReference* KObject::GetWeakReference()
+{
+	KObjectWeakReference* reference = this->weakReference;
+	
+	if (reference == NULL) {
+		reference = (KObjectWeakReference*)WeakReferenceCache.allocate(sizeof(KObjectWeakReference));
+		assert(reference != NULL);
+		
+		// The object holds the first count
+		reference->object = this;
+		reference->count = 1;
+		
+		// Someone else may have made one meanwhile
+		if (!__sync_bool_compare_and_swap(&this->weakReference, NULL, reference)) {
+			KObjectWeakReference::Construct(reference);
+			ObjectCache::Free(reference);
+			reference = this->weakReference;
+		}
+	}
+	
+	reference->Retain();
+	
+	return reference;
+}
+
+void KObjectWeakReference::Construct(void* block)
+{
+	KObjectWeakReference* reference = (KObjectWeakReference*)block;
+	
+	reference->object = NULL;
+	reference->count = 0;
+	reference->lock = 0;
+}
+
+uint32_t KObjectWeakReference::lockObject()
+{
+	return SpinlockLockSave(&this->lock);
+}
+
+void KObjectWeakReference::unlockObject(uint32_t interrupts)
+{
+	SpinlockUnlockRestore(&this->lock, interrupts);
+}
+
+KObject* KObjectWeakReference::Lock()
+{
+	uint32_t interrupts = this->lockObject();
+	KObject* obj = this->object;
+	
+	if (obj != NULL && !obj->TryRetain())
+		obj = NULL;
+	
+	this->unlockObject(interrupts);
+	
+	return obj;
+}
+
+void KObjectWeakReference::Release()
+{
+	int32_t rc = __sync_sub_and_fetch(&this->count, 1);
+	
+	assert(rc >= 0);
+	
+	if (rc == 0)
+		ObjectCache::Free(this);
 }
 
 
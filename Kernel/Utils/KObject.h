@@ -27,6 +27,8 @@
 #include <CoreSystem/CommonTypes.h>
 #include "Error/Assert.h"
 #include "Logging/Logging.h"
+#include "Memory/ObjectCache.h"
+#include "Utils/Spinlock.h"
 
 //
 // Ptr and GlobalPtr
@@ -41,10 +43,41 @@
 // destructors to make it usable in global/static
 // scope.
 //
+// A Ptr that is not needed anymore can be handed
+// on with Move, which transfers its reference
+// instead of taking a new one.
 //
+// BorrowedPtr refers to an object without holding
+// a reference. Use it for parameters and locals
+// that only use an object someone else keeps alive.
+//
+// WeakPtr refers to an object without keeping it
+// alive, for back references that would otherwise
+// make a cycle. See below.
+//
+
+//
+// Casts value to an rvalue reference, so the
+// reference held by a Ptr can be moved out of it
+//
+template <class T> struct RemoveReference { typedef T Type; };
+template <class T> struct RemoveReference<T&> { typedef T Type; };
+template <class T> struct RemoveReference<T&&> { typedef T Type; };
+
+template <class T>
+inline typename RemoveReference<T>::Type&& Move(T&& value)
+{
+	return static_cast<typename RemoveReference<T>::Type&&>(value);
+}
+
+template <class T>
+class Ptr;
 
 template <class T>
 class GlobalPtr {
+	template <class TOther> friend class GlobalPtr;
+	template <class TOther> friend class Ptr;
+	template <class TOther> friend class WeakPtr;
 private:
 	// Disallow dynamic instances
 	void* operator new(size_t) = delete;
@@ -54,25 +87,51 @@ private:
 protected:
 	// Reference to the object
 	T* object;
+	
+	//
+	// Takes over the reference other holds
+	//
+	template <class TOther>
+	void take(Ptr<TOther>& other)
+	{
+		T* obj = other.object;
+		
+		other.object = NULL;
+		
+		// Release last, the old object may hold the new one
+		T* old = this->object;
+		this->object = obj;
+		
+		if (old != NULL)
+			old->Release();
+	}
 public:
+	GlobalPtr() = default;
+	
+	// Copies only alias the object, they hold no reference
+	GlobalPtr(GlobalPtr<T> const&) = default;
 	
 	void operator=(T* other)
 	{
-		if (this->object != NULL)
-			this->object->Release();
-		
 		if (other != NULL)
 			other->Retain();
+		
+		T* old = this->object;
 		this->object = other;
+		
+		if (old != NULL)
+			old->Release();
 	}
 	
-	void operator=(GlobalPtr<T> other)
+	void operator=(GlobalPtr<T> const& other)
 	{
-		if (this->object != NULL)
-			this->object->Release();
-		if (*other != NULL)
-			other->Retain();
-		this->object = *other;
+		*this = *other;
+	}
+	
+	template <class TOther>
+	void operator=(Ptr<TOther>&& other)
+	{
+		this->take(other);
 	}
 
 	bool operator==(GlobalPtr<T> other)
@@ -135,14 +194,109 @@ public:
 	Ptr(GlobalPtr<TOther> const& obj) : Ptr(*obj)
 	{}
 	
+	//
+	// Move constructors, take over the reference of obj
+	// and leave it empty
+	//
+	Ptr(Ptr<T>&& obj)
+	{
+		this->object = obj.object;
+		obj.object = NULL;
+	}
+	
+	template <class TOther>
+	Ptr(Ptr<TOther>&& obj)
+	{
+		this->object = obj.object;
+		obj.object = NULL;
+	}
+	
 	~Ptr()
 	{		
 		if (this->object != NULL)
 			this->object->Release();
 	}
+	
+	void operator=(Ptr<T> const& other)
+	{
+		GlobalPtr<T>::operator=(*other);
+	}
+	
+	void operator=(Ptr<T>&& other)
+	{
+		this->take(other);
+	}
+};
+
+template <class T>
+class BorrowedPtr : public GlobalPtr<T> {
+public:
+	BorrowedPtr(T* obj)
+	{
+		this->object = obj;
+	}
+	
+	BorrowedPtr(BorrowedPtr<T> const&) = default;
+	
+	template <class TOther>
+	BorrowedPtr(GlobalPtr<TOther> const& obj)
+	{
+		this->object = *obj;
+	}
+	
+	// Only rebinds, references are never touched
+	void operator=(BorrowedPtr<T> other)
+	{
+		this->object = *other;
+	}
+};
+
+class Arena;
+class KObject;
+
+//
+// The block WeakPtrs point to instead of the object.
+// The object and every WeakPtr hold a count on it,
+// so it outlives the object and knows when it is gone.
+//
+class KObjectWeakReference {
+	friend class KObject;
+private:
+	// NULL once the object is destroyed
+	KObject* object;
+	int32_t count;
+	Spinlock lock;
+	
+	uint32_t lockObject();
+	void unlockObject(uint32_t interrupts);
+public:
+	//
+	// Sets up a block in the object cache. Freed blocks
+	// are always detached, unlocked and without count,
+	// so this is only done once per block.
+	//
+	static void Construct(void* block);
+	
+	void Retain()
+	{
+		__sync_add_and_fetch(&this->count, 1);
+	}
+	
+	void Release();
+	
+	//
+	// Takes a reference to the object
+	//
+	// @return the object or NULL if it is gone or
+	//         being destroyed
+	//
+	KObject* Lock();
 };
 
 class KObject {
+	friend class Arena;
+	friend class KObjectWeakReference;
+	template <class T> friend class WeakPtr;
 private:
 	//
 	// Count how many objects hold a reference to this
@@ -150,10 +304,68 @@ private:
 	//
 	int32_t retainCount;
 	
+	//
+	// Set for objects created in an Arena, which
+	// frees their memory on its own
+	//
+	bool arenaAllocated;
+	
+	//
+	// Made when the first WeakPtr to this object is
+	// made, and detached when the object is destroyed
+	//
+	KObjectWeakReference* weakReference;
+	
+	//
+	// Retains the object unless its count already
+	// dropped to zero
+	//
+	bool TryRetain()
+	{
+		int32_t rc = this->retainCount;
+		
+		while (rc > 0) {
+			int32_t old = __sync_val_compare_and_swap(&this->retainCount, rc, rc + 1);
+			
+			if (old == rc)
+				return true;
+			
+			rc = old;
+		}
+		
+		return false;
+	}
+	
+	//
+	// @return the weak reference block with a count
+	//         taken for the caller
+	//
+	KObjectWeakReference* GetWeakReference();
+	
+	//
+	// Links objects waiting to be destroyed
+	//
+	KObject* nextDeferred;
+	friend void ReclaimDeferredObjects();
+	
+	//
+	// Destroys the object, or defers it when called
+	// from an interrupt handler
+	//
+	void Destroy();
+	
+	//
+	// Runs the destructor and frees the memory
+	//
+	void DestroyNow();
+	
 public:
 	KObject()
 	{
 		this->retainCount = 0;
+		this->arenaAllocated = false;
+		this->weakReference = NULL;
+		this->nextDeferred = NULL;
 	}
 	
 	virtual ~KObject();
@@ -183,8 +395,101 @@ public:
 		//
 		assert(rc >= 0);
 	
-		if (rc == 0) {
-			delete this;
-		}
+		if (rc == 0)
+			this->Destroy();
 	}
 };
+
+//
+// WeakPtr
+// =======
+//
+// A WeakPtr does not keep its object alive. lock()
+// gives a Ptr to it, which is NULL once the object
+// is gone. Only objects held by a Ptr can be locked.
+//
+// Locking takes a short spinlock on the weak
+// reference block and one atomic for the reference.
+//
+
+template <class T>
+class WeakPtr {
+private:
+	// Disallow dynamic instances
+	void* operator new(size_t) = delete;
+	void* operator new[](size_t) = delete;
+	void operator delete(void *) = delete;
+	void operator delete[](void*) = delete;
+	
+	KObjectWeakReference* reference;
+public:
+	WeakPtr() : reference(NULL)
+	{}
+	
+	WeakPtr(T* obj) : reference(NULL)
+	{
+		if (obj != NULL)
+			this->reference = static_cast<KObject*>(obj)->GetWeakReference();
+	}
+	
+	template <class TOther>
+	WeakPtr(GlobalPtr<TOther> const& obj) : WeakPtr(static_cast<T*>(*obj))
+	{}
+	
+	WeakPtr(WeakPtr<T> const& other) : reference(other.reference)
+	{
+		if (this->reference != NULL)
+			this->reference->Retain();
+	}
+	
+	WeakPtr(WeakPtr<T>&& other) : reference(other.reference)
+	{
+		other.reference = NULL;
+	}
+	
+	~WeakPtr()
+	{
+		if (this->reference != NULL)
+			this->reference->Release();
+	}
+	
+	// other is a copy, so it releases the old reference
+	void operator=(WeakPtr<T> other)
+	{
+		KObjectWeakReference* old = this->reference;
+		
+		this->reference = other.reference;
+		other.reference = old;
+	}
+	
+	Ptr<T> lock() const
+	{
+		Ptr<T> ptr;
+		
+		if (this->reference != NULL)
+			ptr.object = static_cast<T*>(this->reference->Lock());
+		
+		return ptr;
+	}
+};
+
+//
+// Cached KObjects
+// ===============
+//
+// Subclasses which are created and released often can be served
+// by an ObjectCache instead of the general heap. Put KOBJECT_CACHED
+// into the class declaration (it leaves the access at public) and
+// KOBJECT_CACHE(Class) into one implementation file.
+//
+// Subclasses of a cached class larger than it fall back to kalloc,
+// unless they declare their own cache.
+//
+#define KOBJECT_CACHED \
+	private: \
+		static ObjectCache objectCache; \
+	public: \
+		__attribute__ ((noinline)) static void* operator new(size_t size) { return objectCache.allocate(size, __builtin_return_address(0)); } \
+		static void operator delete(void* object) { ObjectCache::Free(object); }
+
+#define KOBJECT_CACHE(Class) ObjectCache Class::objectCache(#Class, sizeof(Class))
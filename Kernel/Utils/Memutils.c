@@ -43,7 +43,7 @@ void *memset(void *_b, int c, size_t len)
 {
 	char *b = _b;
 	
-	for (size_t i = 0; i < len; i++)
+	for (size_t i = 0; i < len; i++, b++)
 		*b = (char)c;
 	
 	return _b;
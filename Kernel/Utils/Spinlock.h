@@ -0,0 +1,86 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <CoreSystem/CommonTypes.h>
+#include <CoreSystem/MachineInstructions.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Spinlocks
+// =========
+//
+// A spinlock protects data shared by all cpus. It is only held
+// for short, and never while something could wait for it on the
+// same cpu, so interrupts have to be off while it is held.
+//
+// A zeroed spinlock is unlocked.
+//
+typedef volatile uint32_t Spinlock;
+
+//
+// Takes the lock, interrupts have to be disabled by the caller
+//
+static inline void SpinlockLock(Spinlock* lock)
+{
+	while (__sync_lock_test_and_set(lock, 1)) {
+		while (*lock);
+	}
+}
+
+static inline void SpinlockUnlock(Spinlock* lock)
+{
+	__sync_lock_release(lock);
+}
+
+//
+// Disables interrupts and takes the lock
+//
+// @return the interrupt state to pass to SpinlockUnlockRestore
+//
+static inline uint32_t SpinlockLockSave(Spinlock* lock)
+{
+	uint32_t interrupts = SaveAndDisableInterrupts();
+	
+	SpinlockLock(lock);
+	
+	return interrupts;
+}
+
+//
+// Releases the lock and restores the interrupts
+//
+static inline void SpinlockUnlockRestore(Spinlock* lock, uint32_t interrupts)
+{
+	SpinlockUnlock(lock);
+	RestoreInterrupts(interrupts);
+}
+
+#ifdef __cplusplus
+}
+#endif
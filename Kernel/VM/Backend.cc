@@ -54,6 +54,11 @@ void Initialize()
 	LogVerbose("VM subsystem initialized.");
 }
 
+void AccountKernelMappings()
+{
+	Native::AccountKernelMappings();
+}
+
 //
 // The Kernel Context
 // ==================
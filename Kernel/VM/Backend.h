@@ -68,6 +68,14 @@ enum {
 //
 void Initialize();
 
+//
+// Accounts every page mapped in the kernel context so far in
+// the frame database. The kernel context is set up before the
+// database can be attached, so this is called right after
+// attaching it.
+//
+void AccountKernelMappings();
+
 class Context : public KObject {
 private:
 	// Access controll
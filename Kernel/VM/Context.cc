@@ -46,7 +46,7 @@ Context::~Context()
 {
 }
 
-Ptr<Backend::Context> Context::getBackend() const
+BorrowedPtr<Backend::Context> Context::getBackend() const
 {
 	return this->backend;
 }
@@ -67,9 +67,10 @@ public:
 	virtual ~Context();
 	
 	///
-	/// Get the backend used to map.
+	/// Get the backend used to map, without taking
+	/// a reference.
 	///
-	Ptr<Backend::Context> getBackend() const;
+	BorrowedPtr<Backend::Context> getBackend() const;
 };
 	
 } // namespace VM
@@ -52,10 +52,8 @@ FixedStore::FixedStore(page_t* _pages, size_t _numberOfPages, bool _writeable, b
 FixedStore::~FixedStore()
 {
 	if (this->free) {
-		if (this->pages) {
-			for (uint32_t i = 0; i < this->numberOfPages; i++)
-				_PhyMemMarkFree(this->pages[i]);
-		}
+		if (this->pages)
+			PhyMemFreeBatch(this->pages, this->numberOfPages);
 		else
 			_PhyMemMarkFreeRange(this->startPage, this->numberOfPages * kPhyMemPageSize);
 	}
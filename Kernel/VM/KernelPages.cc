@@ -0,0 +1,143 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "KernelPages.h"
+
+#include "VM/VM.h"
+#include "VM/Backend.h"
+#include "Error/Assert.h"
+
+namespace VM {
+
+static uint32_t SlabPagesBitmap[kSlabPagesCount / 32];
+KernelPageRange SlabPages(kSlabPagesAddress, kSlabPagesCount, SlabPagesBitmap);
+
+static uint32_t HeapPagesBitmap[kHeapPagesCount / 32];
+KernelPageRange HeapPages(kHeapPagesAddress, kHeapPagesCount, HeapPagesBitmap);
+
+static uint32_t OwnerMapPagesBitmap[kOwnerMapPagesCount / 32];
+KernelPageRange OwnerMapPages(kOwnerMapPagesAddress, kOwnerMapPagesCount, OwnerMapPagesBitmap);
+
+bool KernelPageRange::findFree(size_t count, size_t* firstPage) const
+{
+	size_t run = 0;
+	
+	for (size_t page = this->firstFreePage; page < this->pageCount; page++) {
+		// Skip full words at once
+		if ((page & 0x1F) == 0 && page + 32 <= this->pageCount && this->bitmap[page / 32] == kUInt32Max) {
+			run = 0;
+			page += 31;
+		}
+		else if (this->bitmap[page / 32] & (1U << (page & 0x1F))) {
+			run = 0;
+		}
+		else if (++run == count) {
+			*firstPage = page + 1 - count;
+			
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+void KernelPageRange::markPages(size_t firstPage, size_t count, bool used)
+{
+	for (size_t page = firstPage; page < firstPage + count; page++) {
+		if (used)
+			this->bitmap[page / 32] |= 1U << (page & 0x1F);
+		else
+			this->bitmap[page / 32] &= ~(1U << (page & 0x1F));
+	}
+	
+	if (used && firstPage == this->firstFreePage)
+		this->firstFreePage = firstPage + count;
+	else if (!used && firstPage < this->firstFreePage)
+		this->firstFreePage = firstPage;
+}
+
+pointer_t KernelPageRange::allocate(size_t count, bool zeroed)
+{
+	size_t firstPage;
+	
+	if (!IsKernelContextActive() || count == 0)
+		return NULL;
+	
+	uint32_t interrupts = SpinlockLockSave(&this->lock);
+	bool found = this->findFree(count, &firstPage);
+	
+	if (found)
+		this->markPages(firstPage, count, true);
+	
+	SpinlockUnlockRestore(&this->lock, interrupts);
+	
+	if (!found)
+		return NULL;
+	
+	Ptr<Backend::Context> kernelContext = Backend::GetKernelContext();
+	pointer_t address = (pointer_t)(this->base + firstPage * kPhyMemPageSize);
+	
+	for (size_t i = 0; i < count; i++) {
+		page_t page;
+		bool success = zeroed ? PhyMemAllocZeroed(&page) : PhyMemAlloc(&page);
+		
+		if (!success) {
+			// Give back what we got so far, and the
+			// address space of the rest
+			this->free(address, i);
+			
+			interrupts = SpinlockLockSave(&this->lock);
+			this->markPages(firstPage + i, count - i, false);
+			SpinlockUnlockRestore(&this->lock, interrupts);
+			
+			return NULL;
+		}
+		
+		assert(kernelContext->map(page, OFFSET(address, i * kPhyMemPageSize), Permission::Read | Permission::Write, 0));
+	}
+	
+	return address;
+}
+
+void KernelPageRange::free(pointer_t address, size_t count)
+{
+	assert(this->contains(address));
+	
+	Ptr<Backend::Context> kernelContext = Backend::GetKernelContext();
+	size_t firstPage = ((offset_t)address - this->base) / kPhyMemPageSize;
+	
+	for (size_t i = 0; i < count; i++) {
+		pointer_t vaddr = OFFSET(address, i * kPhyMemPageSize);
+		page_t page = kernelContext->translate(vaddr);
+		
+		assert(kernelContext->unmap(vaddr));
+		PhyMemFree(page);
+	}
+	
+	uint32_t interrupts = SpinlockLockSave(&this->lock);
+	this->markPages(firstPage, count, false);
+	SpinlockUnlockRestore(&this->lock, interrupts);
+}
+
+} // namespace VM
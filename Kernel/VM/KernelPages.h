@@ -0,0 +1,105 @@
+//
+// Copyright (c) 2013, Christian Speich
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//     * Redistributions of source code must retain the above copyright
+//       notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+// WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+// DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+// ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include <CoreSystem/CommonTypes.h>
+
+#include "Memory/PhyMem.h"
+#include "Utils/Spinlock.h"
+
+namespace VM {
+
+//
+// Kernel page ranges
+// ==================
+//
+// A KernelPageRange hands out pages from a reserved part of the
+// kernel context, each backed by a fresh physical page.
+//
+// Pages can only be handed out once the kernel context is active,
+// before that allocate always fails.
+//
+// Ranges are used from all cpus, the bitmap is only touched with
+// the range locked. Mapping and unmapping happens without the lock.
+//
+class KernelPageRange {
+private:
+	offset_t base;
+	size_t pageCount;
+	// One bit per page, set when used
+	uint32_t* bitmap;
+	// No page below this one is free
+	size_t firstFreePage;
+	Spinlock lock;
+	
+	// Both need the range locked
+	bool findFree(size_t count, size_t* firstPage) const;
+	void markPages(size_t firstPage, size_t count, bool used);
+public:
+	//
+	// @param bitmap Storage for pageCount bits
+	//
+	constexpr KernelPageRange(offset_t _base, size_t _pageCount, uint32_t* _bitmap)
+		: base(_base), pageCount(_pageCount), bitmap(_bitmap), firstFreePage(0), lock(0)
+	{}
+	
+	//
+	// Allocates and maps count contiguous pages
+	//
+	// @param zeroed Take the pages from PhyMemAllocZeroed, so
+	//               they are filled with zeros
+	//
+	// @return the address of the first page or NULL
+	//
+	pointer_t allocate(size_t count, bool zeroed = false);
+	
+	//
+	// Unmaps count pages and gives them back to PhyMem
+	//
+	void free(pointer_t address, size_t count);
+	
+	bool contains(pointer_t address) const
+	{
+		return (offset_t)address >= this->base &&
+		       (offset_t)address - this->base < this->pageCount * kPhyMemPageSize;
+	}
+};
+
+//
+// Pages used by the object caches
+//
+extern KernelPageRange SlabPages;
+
+//
+// Pages kalloc grows its heaps into
+//
+extern KernelPageRange HeapPages;
+
+//
+// Pages holding the leaves of the page owner map
+//
+extern KernelPageRange OwnerMapPages;
+
+} // namespace VM
@@ -30,6 +30,8 @@
 
 namespace VM {
 
+KOBJECT_CACHE(Layer);
+
 Layer::Layer(Ptr<Layer> _parent)
 {
 	this->store = NULL;
@@ -47,9 +49,15 @@ Layer::~Layer()
 	
 }
 
-bool Layer::handleFault(uint32_t vaddr, Permission permissions, Ptr<Region> region)
+bool Layer::handleFault(uint32_t vaddr, Permission permissions, BorrowedPtr<Region> region)
 {
-	Ptr<Backend::Context> backend = region->getContext()->getBackend();
+	Ptr<Context> context = region->getContext();
+	
+	// The context is going away
+	if (!context)
+		return false;
+	
+	BorrowedPtr<Backend::Context> backend = context->getBackend();
 	
 	// TODO: first we need to check out local cache
 	
@@ -77,7 +77,7 @@ public:
 	///
 	/// @param permissions the permissions the layer should map
 	///
-	bool handleFault(uint32_t vaddr, Permission permissions, Ptr<Region> region);
+	bool handleFault(uint32_t vaddr, Permission permissions, BorrowedPtr<Region> region);
 	
 	///
 	/// Gets the size of this layer
@@ -89,6 +89,8 @@ public:
 	/// This means only the phy pages directly hold by this layer.
 	///
 	virtual size_t getRealSize() const;
+	
+	KOBJECT_CACHED
 };
 
 } // namespace VM
@@ -28,6 +28,8 @@
 
 namespace VM {
 
+KOBJECT_CACHE(Region);
+
 // Default constructor
 Region::Region(Ptr<Layer> _layer, offset_t _offset, Permission _permissions, Ptr<Context> _context)
 {
@@ -38,7 +40,7 @@ Region::Region(Ptr<Layer> _layer, offset_t _offset, Permission _permissions, Ptr
 	this->size = _layer->getSize();
 	this->permissions = _permissions;
 	
-	this->context->addRegion(this);
+	_context->addRegion(this);
 }
 	
 // Copy constructor
@@ -50,7 +52,7 @@ Region::Region(Ptr<Region>& _region, offset_t _offset, Permission _permissions,
 	this->type = _region->type;
 	this->permissions = _permissions;
 	
-	this->context->addRegion(this);
+	_context->addRegion(this);
 }
 
 Region::~Region()
@@ -79,12 +81,15 @@ size_t Region::getSize() const
 
 Ptr<Context> Region::getContext() const
 {
-	return this->context;
+	return this->context.lock();
 }
 
 void Region::removeFromContext()
 {
-	this->context->removeRegion(this);
+	Ptr<Context> context = this->context.lock();
+	
+	if (context)
+		context->removeRegion(this);
 }
 
 bool Region::handleFault(uint32_t vaddr, Permission _permissions)
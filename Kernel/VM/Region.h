@@ -52,7 +52,7 @@ enum class RegionType : unsigned short {
 class Region : public KObject {
 
 protected:
-	Context* context; /// The parent context for this region (weak to avoid cycles)
+	WeakPtr<Context> context; /// The parent context for this region (weak to avoid cycles)
 	Ptr<Layer> layer; /// The layer providing content for this region
 	
 	/// The offset in the context (start address)
@@ -107,7 +107,7 @@ public:
 	size_t getSize() const;
 	
 	///
-	/// Get the context
+	/// Get the context, NULL once it is gone
 	///
 	Ptr<Context> getContext() const;
 	
@@ -127,6 +127,8 @@ public:
 	///
 	bool fault(Permission permissions);
 	bool fault();
+	
+	KOBJECT_CACHED
 };
 
 } //namespace VM
@@ -29,14 +29,36 @@
 #include "Layer.h"
 #include "Region.h"
 #include "KernelInfo.h"
+#include "KernelPages.h"
+#include "Boot/Bootstrap.h"
+#include "Memory/kalloc.h"
+#include "Memory/Arena.h"
 #include "Logging/Logging.h"
 
 namespace VM {
 
 GlobalPtr<Context> KernelContext;
+static bool KernelContextActive = false;
+
+//
+// The objects describing the kernel context live as long as the
+// kernel, so they are bump allocated from an arena which is never
+// released
+//
+static Arena* BootArena;
 
 void SetupKernelContext();
 
+static void* AllocateHeapPages(size_t count)
+{
+	return HeapPages.allocate(count);
+}
+
+static void ReleaseHeapPages(void* address, size_t count)
+{
+	HeapPages.free(address, count);
+}
+
 void Initialize()
 {
 	Backend::Initialize();
@@ -46,34 +68,60 @@ void Initialize()
 
 void SetupKernelContext()
 {
-	KernelContext = new Context(Backend::GetKernelContext());
+	Arena* arena = BootArena = new Arena();
+	
+	KernelContext = arena->create<Context>(Backend::GetKernelContext());
 	Ptr<Layer> layer;
 	Ptr<Region> region;
 
 	// Text Section
 	// Create a layer with the parts the bootloader loaded for us
-	layer = new Layer(new FixedStore(KernelTextOffset, KernelTextLength/kPhyMemPageSize));
+	layer = arena->create<Layer>(arena->create<FixedStore>(KernelTextOffset, KernelTextLength/kPhyMemPageSize));
 	// And create a region in the kernel context
-	region = new Region(layer, (offset_t)KernelTextOffset + KERNEL_LOAD_ADDRESS, Permission::Read | Permission::Execute, KernelContext);
+	region = arena->create<Region>(layer, (offset_t)KernelTextOffset + KERNEL_LOAD_ADDRESS, Permission::Read | Permission::Execute, KernelContext);
 	// We need to fault this manually, as the fault handling code would not be present
 	region->fault();
 
 	// Data section
-	layer = new Layer(new FixedStore(KernelDataOffset, KernelDataLength/kPhyMemPageSize));
-	region = new Region(layer, (offset_t)KernelDataOffset + KERNEL_LOAD_ADDRESS, Permission::Read | Permission::Write | Permission::Execute, KernelContext);
+	layer = arena->create<Layer>(arena->create<FixedStore>(KernelDataOffset, KernelDataLength/kPhyMemPageSize));
+	region = arena->create<Region>(layer, (offset_t)KernelDataOffset + KERNEL_LOAD_ADDRESS, Permission::Read | Permission::Write | Permission::Execute, KernelContext);
 	region->fault();
 
 	// ROData
-	layer = new Layer(new FixedStore(KernelRODataOffset, KernelRODataLength/kPhyMemPageSize));
-	region = new Region(layer, (offset_t)KernelRODataOffset + KERNEL_LOAD_ADDRESS, Permission::Read | Permission::Execute, KernelContext);
+	layer = arena->create<Layer>(arena->create<FixedStore>(KernelRODataOffset, KernelRODataLength/kPhyMemPageSize));
+	region = arena->create<Region>(layer, (offset_t)KernelRODataOffset + KERNEL_LOAD_ADDRESS, Permission::Read | Permission::Execute, KernelContext);
 	region->fault();
 
 	// VGA
-	layer = new Layer(new FixedStore((page_t)0xB8000, 16*1024));
-	region = new Region(layer, 0xC00B8000, Permission::Read | Permission::Write, KernelContext);
+	layer = arena->create<Layer>(arena->create<FixedStore>((page_t)0xB8000, 16*1024));
+	region = arena->create<Region>(layer, 0xC00B8000, Permission::Read | Permission::Write, KernelContext);
+	region->fault();
+
+	// PhyMem bitmaps, keep them where bootstrap put them
+	page_t bitmapPage;
+	size_t bitmapPageCount;
+	PhyMemGetBitmapPages(&bitmapPage, &bitmapPageCount);
+	layer = arena->create<Layer>(arena->create<FixedStore>(bitmapPage, bitmapPageCount, true, false));
+	region = arena->create<Region>(layer, kBootstrapPhyMemBitmapAddress, Permission::Read | Permission::Write, KernelContext);
+	region->fault();
+
+	// Page frame database
+	page_t frameDatabasePage;
+	size_t frameDatabasePageCount;
+	PhyMemGetFrameDatabasePages(&frameDatabasePage, &frameDatabasePageCount);
+	layer = arena->create<Layer>(arena->create<FixedStore>(frameDatabasePage, frameDatabasePageCount, true, false));
+	region = arena->create<Region>(layer, kFrameDatabaseAddress, Permission::Read | Permission::Write, KernelContext);
 	region->fault();
 
 	ActivateContext(KernelContext);
+	KernelContextActive = true;
+	
+	// The database is accessible now, count what got mapped before
+	PhyMemAttachFrameDatabase((pointer_t)kFrameDatabaseAddress);
+	Backend::AccountKernelMappings();
+	
+	// Heaps can grow now
+	KallocSetPageProvider(AllocateHeapPages, ReleaseHeapPages);
 }
 
 void ActivateContext(Ptr<Context> context)
@@ -81,4 +129,9 @@ void ActivateContext(Ptr<Context> context)
 	context->getBackend()->activate();
 }
 
+bool IsKernelContextActive()
+{
+	return KernelContextActive;
+}
+
 } // namespace VM
@@ -31,8 +31,45 @@
 namespace VM {
 class Context;
 
+//
+// Reserved for pages of the object caches
+//
+static const offset_t kSlabPagesAddress = 0xD0000000;
+static const size_t kSlabPagesCount = 16 * 1024 /* 64 MiB */;
+
+//
+// Reserved for the heaps kalloc grows into
+//
+static const offset_t kHeapPagesAddress = 0xD4000000;
+static const size_t kHeapPagesCount = 32 * 1024 /* 128 MiB */;
+
+//
+// Reserved for the leaves of the page owner map, one
+// page for every 4 MiB of address space
+//
+static const offset_t kOwnerMapPagesAddress = 0xDC000000;
+static const size_t kOwnerMapPagesCount = 1024 /* 4 MiB */;
+
+//
+// Where the page frame database gets mapped in the
+// kernel context
+//
+static const offset_t kFrameDatabaseAddress = 0xE0000000;
+
+//
+// One page per cpu in the kernel context, used to
+// temporarly map physical pages
+//
+static const offset_t kScratchPagesAddress = 0xEFFF0000;
+
 void Initialize();
 
 void ActivateContext(Ptr<Context> context);
 
+//
+// Whether the kernel context is active, so new
+// mappings in it are usable right away
+//
+bool IsKernelContextActive();
+
 } // namespace VM